@@ -0,0 +1,259 @@
+/*
+ * Copyright 2008-2010 Voormedia B.V.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Ruby extension library providing a client API to the Sedna native XML
+ * database management system, based on the official Sedna C driver.
+ *
+ * This file contains the benchmarks of the bundled C driver. They are run
+ * against the mock server of bench/mock_server.rb by bench/sedna_bench.rb,
+ * which measures the Ruby extension in the same way. Each result is printed
+ * as a JSON object on a line of its own.
+ *
+ * Usage: driver_bench [host:port]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "libsedna.h"
+
+#define CONNECT_ITERATIONS 200
+#define QUERY_ITERATIONS 2000
+#define RESULT_ITERATIONS 5
+#define RESULT_QUERY "items(16, 1048576)"
+#define FRAME_SIZE 262144
+#define FRAME_QUERY "items(16, 1048576, 262144)"
+#define LOAD_ITERATIONS 5
+#define LOAD_BYTES (8 * 1048576)
+#define LOAD_CHUNK 65536
+#define THREAD_QUERIES 1000
+#define MAX_THREADS 8
+
+static const char *host = "127.0.0.1:5050";
+static const struct SednaConnection initializer = SEDNA_CONNECTION_INITIALIZER;
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fail(struct SednaConnection *conn, const char *operation)
+{
+    fprintf(stderr, "driver_bench: %s failed: %s\n", operation, SEgetLastErrorMsg(conn));
+    exit(1);
+}
+
+static struct SednaConnection *open_connection()
+{
+    struct SednaConnection *conn = malloc(sizeof(struct SednaConnection));
+    *conn = initializer;
+    if (SEconnect(conn, host, "test", "SYSTEM", "MANAGER") != SEDNA_SESSION_OPEN)
+        fail(conn, "SEconnect");
+    return conn;
+}
+
+static void close_connection(struct SednaConnection *conn)
+{
+    SEclose(conn);
+    free(conn);
+}
+
+/* executes a query and reads all of its results, returning their size */
+static long query(struct SednaConnection *conn, const char *q)
+{
+    char buf[LOAD_CHUNK];
+    long bytes = 0;
+    int res;
+
+    res = SEexecute(conn, q);
+    if (res == SEDNA_UPDATE_SUCCEEDED)
+        return 0;
+    if (res != SEDNA_QUERY_SUCCEEDED)
+        fail(conn, "SEexecute");
+    while ((res = SEnext(conn)) == SEDNA_NEXT_ITEM_SUCCEEDED)
+    {
+        while ((res = SEgetData(conn, buf, sizeof(buf))) > 0)
+            bytes += res;
+        if (res < 0)
+            fail(conn, "SEgetData");
+    }
+    if (res != SEDNA_RESULT_END)
+        fail(conn, "SEnext");
+    return bytes;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void report_latency(const char *benchmark, double *times, int iterations)
+{
+    double total = 0;
+    int i;
+
+    for (i = 0; i < iterations; i++)
+        total += times[i];
+    qsort(times, iterations, sizeof(double), compare_doubles);
+    printf("{\"suite\":\"driver\",\"benchmark\":\"%s\",\"iterations\":%d,"
+           "\"mean_us\":%.1f,\"p50_us\":%.1f,\"p99_us\":%.1f}\n",
+           benchmark, iterations, total / iterations * 1e6,
+           times[iterations / 2] * 1e6, times[iterations * 99 / 100] * 1e6);
+}
+
+static void report_throughput(const char *benchmark, double bytes, double seconds)
+{
+    printf("{\"suite\":\"driver\",\"benchmark\":\"%s\",\"bytes\":%.0f,"
+           "\"seconds\":%.4f,\"mb_per_s\":%.1f}\n",
+           benchmark, bytes, seconds, bytes / seconds / 1048576);
+}
+
+static void bench_connect()
+{
+    static double times[CONNECT_ITERATIONS];
+    int i;
+
+    for (i = 0; i < CONNECT_ITERATIONS; i++)
+    {
+        double start = now();
+        close_connection(open_connection());
+        times[i] = now() - start;
+    }
+    report_latency("connect", times, CONNECT_ITERATIONS);
+}
+
+static void bench_query_rtt()
+{
+    static double times[QUERY_ITERATIONS];
+    struct SednaConnection *conn = open_connection();
+    int i;
+
+    for (i = 0; i < QUERY_ITERATIONS; i++)
+    {
+        double start = now();
+        query(conn, "<x/>");
+        times[i] = now() - start;
+    }
+    close_connection(conn);
+    report_latency("query_rtt", times, QUERY_ITERATIONS);
+}
+
+static void bench_large_result()
+{
+    struct SednaConnection *conn = open_connection();
+    double bytes = 0, start;
+    int i;
+
+    query(conn, RESULT_QUERY);
+    start = now();
+    for (i = 0; i < RESULT_ITERATIONS; i++)
+        bytes += query(conn, RESULT_QUERY);
+    report_throughput("large_result", bytes, now() - start);
+    close_connection(conn);
+}
+
+/* same as bench_large_result, but items are sent in larger messages */
+static void bench_large_frames()
+{
+    struct SednaConnection *conn = open_connection();
+    int frame_size = FRAME_SIZE;
+    double bytes = 0, start;
+    int i;
+
+    if (SEsetConnectionAttr(conn, SEDNA_ATTR_MAX_MESSAGE_SIZE, &frame_size, sizeof(int)) != SEDNA_SET_ATTRIBUTE_SUCCEEDED)
+        fail(conn, "SEsetConnectionAttr");
+    query(conn, FRAME_QUERY);
+    start = now();
+    for (i = 0; i < RESULT_ITERATIONS; i++)
+        bytes += query(conn, FRAME_QUERY);
+    report_throughput("large_frames", bytes, now() - start);
+    close_connection(conn);
+}
+
+static void bench_bulk_load()
+{
+    struct SednaConnection *conn = open_connection();
+    char *data = malloc(LOAD_CHUNK);
+    double start;
+    int i, offset;
+
+    memset(data, 'x', LOAD_CHUNK);
+    start = now();
+    for (i = 0; i < LOAD_ITERATIONS; i++)
+    {
+        for (offset = 0; offset < LOAD_BYTES; offset += LOAD_CHUNK)
+            if (SEloadData(conn, data, LOAD_CHUNK, "bench", NULL) != SEDNA_DATA_CHUNK_LOADED)
+                fail(conn, "SEloadData");
+        if (SEendLoadData(conn) != SEDNA_BULK_LOAD_SUCCEEDED)
+            fail(conn, "SEendLoadData");
+    }
+    report_throughput("bulk_load", (double)LOAD_ITERATIONS * LOAD_BYTES, now() - start);
+    free(data);
+    close_connection(conn);
+}
+
+static void *thread_queries(void *arg)
+{
+    struct SednaConnection *conn = arg;
+    int i;
+
+    for (i = 0; i < THREAD_QUERIES; i++)
+        query(conn, "<x/>");
+    return NULL;
+}
+
+static void bench_threads()
+{
+    struct SednaConnection *conns[MAX_THREADS];
+    pthread_t threads[MAX_THREADS];
+    double start, seconds;
+    int count, i;
+
+    for (count = 1; count <= MAX_THREADS; count *= 2)
+    {
+        for (i = 0; i < count; i++)
+            conns[i] = open_connection();
+        start = now();
+        for (i = 0; i < count; i++)
+            pthread_create(&threads[i], NULL, thread_queries, conns[i]);
+        for (i = 0; i < count; i++)
+            pthread_join(threads[i], NULL);
+        seconds = now() - start;
+        for (i = 0; i < count; i++)
+            close_connection(conns[i]);
+        printf("{\"suite\":\"driver\",\"benchmark\":\"threads\",\"threads\":%d,"
+               "\"queries\":%d,\"seconds\":%.4f,\"queries_per_s\":%.0f}\n",
+               count, count * THREAD_QUERIES, seconds, count * THREAD_QUERIES / seconds);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1)
+        host = argv[1];
+
+    bench_connect();
+    bench_query_rtt();
+    bench_large_result();
+    bench_large_frames();
+    bench_bulk_load();
+    bench_threads();
+    return 0;
+}
@@ -0,0 +1,273 @@
+# Copyright 2008-2010 Voormedia B.V.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# Ruby extension library providing a client API to the Sedna native XML
+# database management system, based on the official Sedna C driver.
+
+# This file contains a minimal server that speaks the Sedna client protocol
+# (see vendor/sedna/driver/c/sp_defs.h), which is used to benchmark and test
+# the client library without a real database. It understands only a few
+# queries:
+#
+# * <tt>items(count, size)</tt> returns +count+ items of +size+ bytes each.
+#   With <tt>items(count, size, frame)</tt>, items are sent in messages with
+#   bodies of up to +frame+ bytes instead of the usual maximum of MAX_BODY.
+# * <tt>update ...</tt>, <tt>create ...</tt> and <tt>drop ...</tt> succeed
+#   without results.
+# * <tt>LOAD STDIN "name"</tt> accepts a bulk load and discards the data.
+#   A bulk load of a document named +disconnect+ closes the connection, after
+#   which the server refuses all new connections.
+# * <tt>fail_after(count, size)</tt> returns +count+ items like +items+, and
+#   fails with an error in the middle of the next item.
+# * <tt>bad_length(length)</tt> replies with a message header that claims a
+#   body of +length+ bytes, followed by as many bytes if +length+ is positive.
+# * <tt>sleep(seconds)</tt> waits for the given number of seconds, and then
+#   returns its own text as a single item.
+# * Any other query returns its own text as a single item.
+#
+# Sessions for the database +protocol3+ behave like servers that only support
+# version 3.0 of the protocol, and close the connection if another version is
+# requested. Sessions for the database +silent+ never reply to the session
+# parameters, and wait until the client closes the connection.
+#
+# If a query is preceded by <tt>slow </tt>, every reply to it is sent in two
+# halves with a pause in between, so that clients have to wait for the rest
+# of a message.
+#
+# When run as a script, the server is started and the given command is run
+# with the address of the server as its last argument, for example:
+#
+#   ruby bench/mock_server.rb test/driver_test
+
+require 'socket'
+
+class MockSedna
+  # Protocol instructions from sp_defs.h.
+  ERROR_RESPONSE = 100
+  START_UP = 110
+  SEND_SESSION_PARAMETERS = 140
+  SEND_AUTH_PARAMETERS = 150
+  AUTHENTICATION_OK = 160
+  BEGIN_TRANSACTION = 210
+  COMMIT_TRANSACTION = 220
+  ROLLBACK_TRANSACTION = 225
+  BEGIN_TRANSACTION_OK = 230
+  COMMIT_TRANSACTION_OK = 250
+  ROLLBACK_TRANSACTION_OK = 255
+  EXECUTE = 300
+  EXECUTE_LONG = 301
+  LONG_QUERY_END = 302
+  GET_NEXT_ITEM = 310
+  QUERY_SUCCEEDED = 320
+  UPDATE_SUCCEEDED = 340
+  ITEM_START = 355
+  ITEM_PART = 360
+  ITEM_END = 370
+  RESULT_END = 375
+  BULK_LOAD_END = 420
+  BULK_LOAD_FROM_STREAM = 431
+  BULK_LOAD_SUCCEEDED = 440
+  CLOSE_CONNECTION = 500
+  CLOSE_CONNECTION_OK = 510
+  SET_SESSION_OPTIONS = 530
+  SET_SESSION_OPTIONS_OK = 540
+  RESET_SESSION_OPTIONS = 550
+  RESET_SESSION_OPTIONS_OK = 560
+
+  # Maximum body length of a message (SE_SOCKET_MSG_BUF_SIZE).
+  MAX_BODY = 10240
+
+  # Item class and type of results (se_element, se_anyType).
+  ITEM_CLASS = 3
+  ITEM_TYPE = 0
+
+  attr_reader :port
+
+  # Creates a server on the given port of the loopback interface. By default a
+  # free port is chosen.
+  def initialize(port = 0)
+    @server = TCPServer.new "127.0.0.1", port
+    @port = @server.addr[1]
+    @results = {}
+  end
+
+  # Starts serving connections in a child process. Like the Sedna server, a
+  # separate process handles each session, so that neither the server nor the
+  # global VM lock of the client limit the concurrency that is measured.
+  def start
+    @pid = fork do
+      trap("TERM") { exit! }
+      trap("USR1") { @refuse = true }
+      run
+    end
+    self
+  end
+
+  # Stops the server.
+  def stop
+    Process.kill "TERM", @pid
+    Process.wait @pid
+    @server.close
+  end
+
+  private
+
+  def run
+    loop do
+      client = @server.accept
+      next client.close if @refuse
+      client.setsockopt Socket::IPPROTO_TCP, Socket::TCP_NODELAY, 1
+      Process.detach(fork { @server.close; serve client; exit! })
+      client.close
+    end
+  end
+
+  def serve(client)
+    session client
+  rescue IOError, SystemCallError
+  ensure
+    client.close unless client.closed?
+  end
+
+  def session(c)
+    return unless recv(c)[0] == START_UP
+    reply c, SEND_SESSION_PARAMETERS
+    version, database = session_parameters(recv(c)[1])
+    return if database == "protocol3" && version != [3, 0]
+    return c.read if database == "silent"
+    reply c, SEND_AUTH_PARAMETERS
+    recv c
+    reply c, AUTHENTICATION_OK
+    @items = []
+    @slow = false
+    query = ""
+    while message = recv(c)
+      instruction, body = message
+      case instruction
+      when BEGIN_TRANSACTION then reply c, BEGIN_TRANSACTION_OK
+      when COMMIT_TRANSACTION then reply c, COMMIT_TRANSACTION_OK
+      when ROLLBACK_TRANSACTION then reply c, ROLLBACK_TRANSACTION_OK
+      when SET_SESSION_OPTIONS then reply c, SET_SESSION_OPTIONS_OK
+      when RESET_SESSION_OPTIONS then reply c, RESET_SESSION_OPTIONS_OK
+      when EXECUTE then execute c, body[6..-1]
+      when EXECUTE_LONG then query << body[6..-1]
+      when LONG_QUERY_END then execute c, query; query = ""
+      when GET_NEXT_ITEM then next_item c
+      when CLOSE_CONNECTION then reply c, CLOSE_CONNECTION_OK; return
+      end
+    end
+  end
+
+  # Returns the protocol version and database name of a SessionParameters
+  # message body.
+  def session_parameters(body)
+    login_length = body[3, 4].unpack("N")[0]
+    [body[0, 2].unpack("CC"), body[12 + login_length..-1]]
+  end
+
+  def recv(c)
+    header = c.read(8) or return
+    instruction, length = header.unpack("NN")
+    body = length > 0 ? c.read(length) : ""
+    [instruction, body]
+  end
+
+  def reply(c, instruction, body = "")
+    c.write message(instruction, body)
+  end
+
+  def message(instruction, body = "")
+    [instruction, body.length].pack("NN") << body
+  end
+
+  def string(s)
+    [0, s.length].pack("CN") << s
+  end
+
+  def execute(c, query)
+    @slow = !query.sub!(/\Aslow /, "").nil?
+    case query
+    when /\Aitems\((\d+),\s*(\d+)(?:,\s*(\d+))?\)/
+      frame = $3 ? $3.to_i : MAX_BODY
+      @items = Array.new($1.to_i) { |i| result($2.to_i, i > 0, frame) }
+    when /\Afail_after\((\d+),\s*(\d+)\)/
+      @items = Array.new($1.to_i) { |i| result($2.to_i, i > 0, MAX_BODY) }
+      @items << message(ITEM_START, [ITEM_CLASS, ITEM_TYPE, 0].pack("CCC") << string("\nxxx")) +
+        message(ERROR_RESPONSE, [0].pack("N") << string("SEDNA Message: ERROR SE9999\nMock failure."))
+    when /\A(update|create|drop)/
+      return reply(c, UPDATE_SUCCEEDED)
+    when /\Abad_length\((-?\d+)\)/
+      length = $1.to_i
+      return c.write([QUERY_SUCCEEDED, length].pack("NN") << "x" * [length, 0].max)
+    when /\Asleep\(([\d.]+)\)/
+      sleep $1.to_f
+      @items = [item(query)]
+    when /LOAD STDIN "disconnect"/
+      Process.kill "USR1", Process.ppid
+      return c.close
+    when /LOAD STDIN/
+      reply c, BULK_LOAD_FROM_STREAM
+      while message = recv(c)
+        break if message[0] == BULK_LOAD_END
+      end
+      return reply(c, BULK_LOAD_SUCCEEDED)
+    else
+      @items = [item(query)]
+    end
+    write c, message(QUERY_SUCCEEDED)
+    next_item c
+  end
+
+  def next_item(c)
+    write c, (@items.empty? ? message(RESULT_END) : @items.shift)
+  end
+
+  # Writes data, in two halves with a pause in between for slow queries.
+  def write(c, data)
+    if @slow
+      c.write data[0, data.length / 2]
+      c.flush
+      sleep 0.01
+      data = data[data.length / 2..-1]
+    end
+    c.write data
+  end
+
+  # Returns the encoded messages of an item of the given size, which are
+  # cached because benchmarks request the same results over and over. Like
+  # the Sedna server, all items but the first are preceded by a newline.
+  def result(size, newline, frame)
+    @results[[size, newline, frame]] ||= item((newline ? "\n" : "") + "x" * size, frame)
+  end
+
+  def item(data, frame = MAX_BODY)
+    data = data.dup
+    data.force_encoding "binary" if data.respond_to? :force_encoding
+    messages = message(ITEM_START, [ITEM_CLASS, ITEM_TYPE, 0].pack("CCC") << string(data.slice!(0, frame - 8)))
+    until data.empty?
+      messages << message(ITEM_PART, string(data.slice!(0, frame - 5)))
+    end
+    messages << message(ITEM_END)
+  end
+end
+
+if __FILE__ == $0
+  server = MockSedna.new.start
+  begin
+    success = system(*(ARGV + ["127.0.0.1:#{server.port}"]))
+  ensure
+    server.stop
+  end
+  exit(success ? 0 : 1)
+end
@@ -0,0 +1,160 @@
+#!/usr/bin/env ruby
+
+# Copyright 2008-2010 Voormedia B.V.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# Ruby extension library providing a client API to the Sedna native XML
+# database management system, based on the official Sedna C driver.
+
+# This file contains the benchmarks of the Ruby extension. They are run
+# against a mock server (see bench/mock_server.rb), so that they measure the
+# overhead of the client library rather than that of the database. If the path
+# to the compiled bench/driver_bench.c is given as argument, the same
+# benchmarks are run for the bundled C driver afterwards.
+#
+# Each result is printed as a JSON object on a line of its own, so results can
+# be collected and compared between versions with
+#
+#   rake bench OUTPUT=results.json
+
+$:.unshift(File.dirname(__FILE__) + '/../ext/sedna')
+
+require 'sedna'
+require File.expand_path(File.dirname(__FILE__) + '/mock_server')
+
+class SednaBench
+  CONNECT_ITERATIONS = 200
+  QUERY_ITERATIONS = 2000
+  RESULT_ITERATIONS = 5
+  RESULT_QUERY = "items(16, 1048576)"
+  LOAD_ITERATIONS = 5
+  LOAD_BYTES = 8 * 1048576
+  THREAD_QUERIES = 1000
+  MAX_THREADS = 8
+
+  def initialize(host)
+    @spec = { :host => host, :database => "test", :username => "SYSTEM", :password => "MANAGER" }
+  end
+
+  def run
+    bench_connect
+    bench_query_rtt
+    bench_large_result
+    bench_bulk_load
+    bench_threads
+  end
+
+  private
+
+  def now
+    Process.respond_to?(:clock_gettime) ? Process.clock_gettime(Process::CLOCK_MONOTONIC) : Time.now.to_f
+  end
+
+  def measure
+    start = now
+    yield
+    now - start
+  end
+
+  # Prints the given result fields as a JSON object.
+  def report(benchmark, *fields)
+    fields = [[:suite, "ruby"], [:benchmark, benchmark]] + fields
+    puts "{" + fields.map { |key, value| "#{key.to_s.inspect}:#{value.is_a?(String) ? value.inspect : value}" }.join(",") + "}"
+    $stdout.flush
+  end
+
+  def report_latency(benchmark, times)
+    total = times.inject(0) { |sum, time| sum + time }
+    times = times.sort
+    report benchmark, [:iterations, times.length], [:mean_us, us(total / times.length)],
+      [:p50_us, us(times[times.length / 2])], [:p99_us, us(times[times.length * 99 / 100])]
+  end
+
+  def report_throughput(benchmark, bytes, seconds)
+    report benchmark, [:bytes, bytes], [:seconds, round(seconds, 4)], [:mb_per_s, round(bytes / seconds / 1048576, 1)]
+  end
+
+  def us(seconds)
+    round(seconds * 1e6, 1)
+  end
+
+  def round(value, digits)
+    (value * 10 ** digits).round.to_f / 10 ** digits
+  end
+
+  def bench_connect
+    times = Array.new(CONNECT_ITERATIONS) { measure { Sedna.connect(@spec).close } }
+    report_latency "connect", times
+  end
+
+  def bench_query_rtt
+    Sedna.connect @spec do |sedna|
+      times = Array.new(QUERY_ITERATIONS) { measure { sedna.execute "<x/>" } }
+      report_latency "query_rtt", times
+    end
+  end
+
+  def bench_large_result
+    Sedna.connect @spec do |sedna|
+      sedna.execute RESULT_QUERY
+      bytes = 0
+      seconds = measure do
+        RESULT_ITERATIONS.times do
+          sedna.execute(RESULT_QUERY).each { |item| bytes += item.length }
+        end
+      end
+      report_throughput "large_result", bytes, seconds
+    end
+  end
+
+  def bench_bulk_load
+    data = "x" * LOAD_BYTES
+    Sedna.connect @spec do |sedna|
+      seconds = measure do
+        LOAD_ITERATIONS.times { sedna.load_document data, "bench" }
+      end
+      report_throughput "bulk_load", LOAD_ITERATIONS * LOAD_BYTES, seconds
+    end
+  end
+
+  def bench_threads
+    count = 1
+    while count <= MAX_THREADS
+      connections = Array.new(count) { Sedna.connect @spec }
+      seconds = measure do
+        connections.map do |sedna|
+          Thread.new { THREAD_QUERIES.times { sedna.execute "<x/>" } }
+        end.each { |thread| thread.join }
+      end
+      connections.each { |sedna| sedna.close }
+      queries = count * THREAD_QUERIES
+      report "threads", [:threads, count], [:queries, queries], [:seconds, round(seconds, 4)],
+        [:queries_per_s, (queries / seconds).round]
+      count *= 2
+    end
+  end
+end
+
+if __FILE__ == $0
+  server = MockSedna.new.start
+  begin
+    host = "127.0.0.1:#{server.port}"
+    SednaBench.new(host).run
+    if ARGV[0] and not system(ARGV[0], host)
+      abort "#{ARGV[0]} failed."
+    end
+  ensure
+    server.stop
+  end
+end
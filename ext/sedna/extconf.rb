@@ -100,7 +100,18 @@ Could not find header file(s) for libsedna.
 end
 
 have_func "rb_thread_blocking_region"
+have_func "rb_thread_call_without_gvl", "ruby/thread.h"
+have_func "rb_thread_call_with_gvl", "ruby/thread.h"
 have_func "rb_mutex_synchronize"
-have_func "rb_enc_str_buf_cat"
+have_func "rb_fiber_scheduler_current", "ruby/fiber/scheduler.h"
+have_func "rb_io_wait", "ruby/io.h"
+have_func "rb_io_descriptor", "ruby/io.h"
+have_func "rb_io_read_pending", "ruby/io.h"
+have_func "rb_enc_associate"
+have_func "rb_time_timespec_new"
+have_func "SEgetItemClass", "libsedna.h"
+have_func "SEgetProtocolVersion", "libsedna.h"
+have_func "SEexecuteParts", "libsedna.h"
+have_func "SEsetInterruptHandler", "libsedna.h"
 
 create_makefile "sedna"
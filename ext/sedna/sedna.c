@@ -24,10 +24,14 @@
  */
 
 #include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <math.h>
+#include <time.h>
 #include "ruby.h"
 #include "libsedna.h"
 
-// Size of the query result read buffer.
+// Initial size of the query result read buffer.
 #define RESULT_BUF_LEN 8192
 
 // Size of the load_document buffer.
@@ -55,14 +59,50 @@
 #define DEFAULT_USER "SYSTEM"
 #define DEFAULT_PW "MANAGER"
 
+// Default connection pool options.
+#define DEFAULT_POOL_SIZE 5
+#define DEFAULT_POOL_TIMEOUT 5.0
+#define DEFAULT_POOL_IDLE_TIMEOUT 300.0
+
+// Default number of connections of a parallel bulk load.
+#define DEFAULT_BULK_LOAD_WORKERS 4
+
+// Default size of result caches in bytes.
+#define DEFAULT_CACHE_SIZE (8 * 1024 * 1024)
+
+// Default reconnect options, and the maximum delay between attempts in seconds.
+#define DEFAULT_RECONNECT_ATTEMPTS 1
+#define DEFAULT_RECONNECT_DELAY 0.1
+#define MAX_RECONNECT_DELAY 30.0
+
 // Instance variable names.
 #define IV_HOST "@host"
 #define IV_DB "@database"
 #define IV_USER "@username"
 #define IV_PW "@password"
 #define IV_AUTOCOMMIT "@autocommit"
+#define IV_TYPED "@typed_results"
+#define IV_READ_ONLY "@read_only"
+#define IV_QUERY_TIMEOUT "@query_timeout"
 #define IV_MUTEX "@mutex"
 #define IV_EXC_CODE "@code"
+#define IV_EXC_INDEX "@index"
+#define IV_DETAILS "@details"
+#define IV_IDLE "@idle"
+#define IV_COND "@cond"
+#define IV_SEDNA "@sedna"
+#define IV_QUERY "@query"
+#define IV_PARAMS "@parameters"
+#define IV_CACHE "@cache"
+#define IV_CACHE_DIRTY "@cache_dirty"
+#define IV_ENTRIES "@entries"
+#define IV_RECONNECT_ATTEMPTS "@reconnect_attempts"
+#define IV_RECONNECT_DELAY "@reconnect_delay"
+#define IV_RECONNECT_STATS "@reconnect_stats"
+#define IV_INSTRUMENT "@instrument"
+
+// Fiber-local variable names.
+#define TL_WAIT_STATE "__sedna_wait_state__"
 
 // Define a shorthand for the common SednaConnection structure.
 typedef struct SednaConnection SC;
@@ -71,9 +111,40 @@ typedef struct SednaConnection SC;
 struct SednaQuery {
 	void *conn;
 	char *query;
+	int typed;
+	int sxml;
+	const char **parts;
+	int *lengths;
+	int count;
+	int updated;
+	int read_only;
+	int timeout;
 };
 typedef struct SednaQuery SQ;
 
+// Define a struct for batches of database queries.
+struct SednaBatch {
+	void *conn;
+	const char **queries;
+	int count;
+	int *results;
+	int executed;
+	int timeout;
+};
+typedef struct SednaBatch SB;
+
+// Define a struct for loading documents.
+struct SednaLoad {
+	void *conn;
+	const char *buf;
+	long length;
+	int fd;
+	char *doc_name;
+	char *col_name;
+	int timeout;
+};
+typedef struct SednaLoad SL;
+
 // Define a struct for database connection arguments.
 struct SednaConnArgs {
 	void *conn;
@@ -84,34 +155,193 @@ struct SednaConnArgs {
 };
 typedef struct SednaConnArgs SCA;
 
-// Always create UTF-8 strings with STR_CAT, if supported (Ruby 1.9).
-#ifdef HAVE_RB_ENC_STR_BUF_CAT
+// Define a struct for reading query results.
+struct SednaRecord {
+	void *conn;
+	VALUE str;
+	char *buf;
+	int buf_size;
+	int new_size;
+	int strip_n;
+	int bytes_read;
+	int has_gvl;
+};
+typedef struct SednaRecord SR;
+
+// Define a struct for connection pools.
+struct SednaPool {
+	int size;
+	int created;
+	double timeout;
+	double idle_timeout;
+	int closed;
+};
+typedef struct SednaPool SP;
+
+// Define a struct for arguments of connection pool operations.
+struct SednaPoolArgs {
+	VALUE pool;
+	VALUE conn;
+	double deadline;
+};
+typedef struct SednaPoolArgs SPA;
+
+// Define a struct for parallel bulk loads.
+struct SednaBulkLoad {
+	VALUE details;
+	VALUE docs;
+	VALUE results;
+	long next;
+	LONG_LONG bytes;
+	int loaded;
+	int failed;
+	int workers;
+};
+typedef struct SednaBulkLoad SBL;
+
+// Define a struct for prepared statements. The query text is split into
+// static parts at the placeholders; parts and lengths hold the static parts
+// interleaved with the parameter literals of each execution.
+struct SednaStatement {
+	int count;
+	long *offsets;
+	long *sizes;
+	const char **parts;
+	int *lengths;
+	long executions;
+	double total_time;
+	double min_time;
+	double max_time;
+};
+typedef struct SednaStatement SS;
+
+// Define a struct for arguments of prepared statement executions.
+struct SednaStatementArgs {
+	VALUE stmt;
+	VALUE literals;
+	long *ends;
+	SQ q;
+	int stream;
+};
+typedef struct SednaStatementArgs SSA;
+
+// Define a struct for result caches. Entries are kept in a Hash in order of
+// use; the generation changes whenever the cache is flushed.
+struct SednaCache {
+	long max_bytes;
+	double ttl;
+	long bytes;
+	long hits;
+	long misses;
+	long generation;
+};
+typedef struct SednaCache SRC;
+
+// Define a struct for operations that were traced by the driver, with copies
+// of the query and document names that the driver only passes temporarily.
+struct SednaEvent {
+	struct se_trace_event trace;
+	char *query;
+	long query_length;
+	char *doc_name;
+	char *col_name;
+};
+typedef struct SednaEvent SIE;
+
+// Define a struct for the instrumentation of a connection. The driver may
+// report operations while the global VM lock is not held, so they are
+// collected in events and passed to the block after the operation.
+struct SednaInstrument {
+	VALUE block;
+	SIE *events;
+	int count;
+	int size;
+	long id;
+};
+typedef struct SednaInstrument SI;
+
+// Always create UTF-8 strings with STR_UTF8, if supported (Ruby 1.9).
+#ifdef HAVE_RB_ENC_ASSOCIATE
 	#ifndef RUBY_ENCODING_H
 		#include "ruby/encoding.h"
 	#endif
-	#define STR_CAT(str, buf, bytes) rb_enc_str_buf_cat(str, buf, bytes, rb_utf8_encoding())
+	#define STR_UTF8(str) rb_enc_associate(str, rb_utf8_encoding())
 #else
-	#define STR_CAT(str, buf, bytes) rb_str_buf_cat(str, buf, bytes)
+	#define STR_UTF8(str) (str)
+#endif
+
+// Define how to run functions without holding the global VM lock.
+#if defined(HAVE_RB_THREAD_CALL_WITHOUT_GVL)
+	// Ruby >= 2.0.
+	#include "ruby/thread.h"
+	#define SEDNA_WITHOUT_GVL(func, arg, ubf, ubf_arg) (int)(VALUE)rb_thread_call_without_gvl((void*)func, arg, ubf, ubf_arg)
+#elif defined(HAVE_RB_THREAD_BLOCKING_REGION)
+	// Ruby 1.9.
+	#define SEDNA_WITHOUT_GVL(func, arg, ubf, ubf_arg) rb_thread_blocking_region((void*)func, arg, ubf, ubf_arg)
 #endif
 
 // Define whether or not non-blocking behaviour will be built in.
-#if defined(HAVE_RB_THREAD_BLOCKING_REGION) && defined(HAVE_RB_MUTEX_SYNCHRONIZE)
+#if defined(SEDNA_WITHOUT_GVL) && defined(HAVE_RB_MUTEX_SYNCHRONIZE)
 	#define NON_BLOCKING 1
 	#define SEDNA_BLOCKING Qfalse
 #else
 	#define SEDNA_BLOCKING Qtrue
 #endif
 
+// Results can only be read without the lock if it can be re-acquired to grow
+// the result strings.
+#if defined(NON_BLOCKING) && defined(HAVE_RB_THREAD_CALL_WITH_GVL)
+	#define NON_BLOCKING_READ 1
+	#define SEDNA_READ(r) sedna_non_blocking_read(r)
+#else
+	#define SEDNA_READ(r) sedna_blocking_read(r)
+#endif
+
+// Let the fiber scheduler wait for the socket if one is active (Ruby >= 3.0),
+// so that other fibers can run instead of blocking the thread.
+#if defined(NON_BLOCKING) && defined(HAVE_RB_FIBER_SCHEDULER_CURRENT) && defined(HAVE_RB_IO_WAIT)
+	#include "ruby/io.h"
+	#include "ruby/fiber/scheduler.h"
+	#define FIBER_SCHEDULER 1
+	#define SEDNA_NONBLOCKING(conn) sedna_nonblocking(conn)
+#else
+	#define SEDNA_NONBLOCKING(conn) 0
+#endif
+
+// Documents can be loaded straight from the file descriptor of an IO object if
+// it can be verified that no data has been buffered by Ruby yet.
+#if defined(HAVE_RB_IO_READ_PENDING)
+	#include "ruby/io.h"
+	#define LOAD_FROM_FD 1
+#endif
+
+// Query results can only be converted according to their type if the driver
+// reports the type of each item.
+#if defined(HAVE_SEGETITEMCLASS)
+	#define SEDNA_ITEM_CLASS(conn) SEgetItemClass(conn)
+	#define SEDNA_ITEM_TYPE(conn) SEgetItemType(conn)
+#else
+	#define SEDNA_ITEM_CLASS(conn) 0
+	#define SEDNA_ITEM_TYPE(conn) -1
+#endif
+
 // Define execute and connect functions.
 #ifdef NON_BLOCKING
 	// Non-blocking variants for >= 1.9.
 	// Synchronize across threads using this instance and execute.
 	#define SEDNA_CONNECT(self, c) rb_mutex_synchronize(rb_iv_get(self, IV_MUTEX), (void*)sedna_non_blocking_connect, (VALUE)c);
-	#define SEDNA_EXECUTE(self, q) rb_mutex_synchronize(rb_iv_get(self, IV_MUTEX), (void*)sedna_non_blocking_execute, (VALUE)q);
+	#define SEDNA_EXECUTE_BATCH(self, b) rb_mutex_synchronize(rb_iv_get(self, IV_MUTEX), (void*)sedna_non_blocking_execute_batch, (VALUE)b);
+	#define SEDNA_LOAD(self, l) rb_mutex_synchronize(rb_iv_get(self, IV_MUTEX), (void*)sedna_non_blocking_load, (VALUE)l);
+	// Run func while holding the mutex of this instance; execute without it.
+	#define SEDNA_SYNCHRONIZE(self, func, arg) rb_mutex_synchronize(rb_iv_get(self, IV_MUTEX), (void*)func, (VALUE)arg);
+	#define SEDNA_EXECUTE_UNLOCKED(q) sedna_non_blocking_execute(q);
 #else
 	// Blocking variants for < 1.9.
 	#define SEDNA_CONNECT(self, c) sedna_blocking_connect(c);
-	#define SEDNA_EXECUTE(self, q) sedna_blocking_execute(q);
+	#define SEDNA_EXECUTE_BATCH(self, b) sedna_blocking_execute_batch(b);
+	#define SEDNA_LOAD(self, l) sedna_blocking_load(l);
+	#define SEDNA_SYNCHRONIZE(self, func, arg) func(arg);
+	#define SEDNA_EXECUTE_UNLOCKED(q) sedna_blocking_execute(q);
 #endif
 
 // Ruby classes.
@@ -121,33 +351,215 @@ static VALUE cSednaException;
 static VALUE cSednaAuthError;
 static VALUE cSednaConnError;
 static VALUE cSednaTrnError;
+static VALUE cSednaBatchError;
+static VALUE cSednaPool;
+static VALUE cSednaBulkLoadReport;
+static VALUE cSednaStatement;
+static VALUE cSednaCache;
+
+
+// Result cache functions ===============================================
+
+// Return the current time in seconds.
+static double sedna_now(void)
+{
+	return NUM2DBL(rb_funcall(rb_funcall(rb_cTime, rb_intern("now"), 0), rb_intern("to_f"), 0));
+}
+
+// Retrieve the SednaCache struct from the Ruby Sedna::Cache object obj.
+static SRC* sedna_cache_struct(VALUE obj)
+{
+	SRC *cache;
+	Data_Get_Struct(obj, SRC, cache);
+	return cache;
+}
+
+// Return a copy of an array of results with copies of all strings. Copies
+// that are kept in the cache are frozen, so that they cannot be changed.
+static VALUE sedna_cache_copy(VALUE results, int frozen)
+{
+	long i;
+	VALUE copy = rb_ary_new2(RARRAY_LEN(results)), item;
+
+	for(i = 0; i < RARRAY_LEN(results); i++) {
+		item = rb_ary_entry(results, i);
+		if(TYPE(item) == T_STRING) item = frozen ? rb_obj_freeze(rb_str_dup(item)) : rb_str_dup(item);
+		rb_ary_push(copy, item);
+	}
+	return frozen ? rb_obj_freeze(copy) : copy;
+}
+
+// Remove the entry for key from the cache, if there is one.
+static void sedna_cache_remove(SRC *cache, VALUE entries, VALUE key)
+{
+	VALUE entry = rb_hash_delete(entries, key);
+	if(!NIL_P(entry)) cache->bytes -= NUM2LONG(rb_ary_entry(entry, 1));
+}
+
+// Return a copy of the cached results of the query key, or Qundef if they
+// are not cached or have expired. Entries that are used move to the end of
+// the hash, so that the least recently used entry is always the first one.
+static VALUE sedna_cache_get(VALUE obj, VALUE key)
+{
+	SRC *cache = sedna_cache_struct(obj);
+	VALUE entries = rb_iv_get(obj, IV_ENTRIES), entry = rb_hash_aref(entries, key);
+
+	if(!NIL_P(entry) && cache->ttl > 0 && NUM2DBL(rb_ary_entry(entry, 2)) < sedna_now()) {
+		sedna_cache_remove(cache, entries, key);
+		entry = Qnil;
+	}
+	if(NIL_P(entry)) {
+		cache->misses++;
+		return Qundef;
+	}
+
+	rb_hash_delete(entries, key);
+	rb_hash_aset(entries, key, entry);
+	cache->hits++;
+	return sedna_cache_copy(rb_ary_entry(entry, 0), 0);
+}
+
+// Store the results of the query key, evicting the least recently used
+// entries until they fit. Results are not stored if the cache was flushed
+// after the query was started, because they may be outdated.
+static void sedna_cache_put(VALUE obj, VALUE key, VALUE results, long generation)
+{
+	SRC *cache = sedna_cache_struct(obj);
+	VALUE entries = rb_iv_get(obj, IV_ENTRIES), item, pair;
+	long i, bytes = RSTRING_LEN(key);
+
+	if(generation != cache->generation) return;
+	for(i = 0; i < RARRAY_LEN(results); i++) {
+		item = rb_ary_entry(results, i);
+		bytes += TYPE(item) == T_STRING ? RSTRING_LEN(item) : (long)sizeof(VALUE);
+	}
+	if(bytes > cache->max_bytes) return;
+
+	sedna_cache_remove(cache, entries, key);
+	while(cache->bytes + bytes > cache->max_bytes && !NIL_P(pair = rb_funcall(entries, rb_intern("shift"), 0))) {
+		cache->bytes -= NUM2LONG(rb_ary_entry(rb_ary_entry(pair, 1), 1));
+	}
+
+	rb_hash_aset(entries, key, rb_ary_new3(3, sedna_cache_copy(results, 1), LONG2NUM(bytes),
+		rb_float_new(cache->ttl > 0 ? sedna_now() + cache->ttl : 0)));
+	cache->bytes += bytes;
+}
+
+// Remove all entries from the cache.
+static void sedna_cache_flush(VALUE obj)
+{
+	SRC *cache = sedna_cache_struct(obj);
+
+	rb_funcall(rb_iv_get(obj, IV_ENTRIES), rb_intern("clear"), 0);
+	cache->bytes = 0;
+	cache->generation++;
+}
+
+// Return the cache key of a query, or nil if the results of the query should
+// not be cached. Queries inside transactions always go to the database, so
+// that they see the changes of the transaction.
+static VALUE sedna_cache_key(VALUE self, SC *conn, SQ *q, VALUE query)
+{
+	char flags = (char)((q->typed ? 1 : 0) | (q->sxml ? 2 : 0));
+	VALUE key;
+
+	if(NIL_P(rb_iv_get(self, IV_CACHE))) return Qnil;
+	if(!RTEST(rb_iv_get(self, IV_AUTOCOMMIT)) || SEtransactionStatus(conn) == SEDNA_TRANSACTION_ACTIVE) return Qnil;
+
+	key = rb_str_buf_new(RSTRING_LEN(query) + 1);
+	rb_str_cat(key, &flags, 1);
+	rb_str_cat(key, RSTRING_PTR(query), RSTRING_LEN(query));
+	return rb_obj_freeze(key);
+}
+
+// Flush the cache of the connection after an update. Updates inside a
+// transaction flush it again when the transaction is committed, because
+// other connections may cache the old data in the meantime.
+static void sedna_cache_updated(VALUE self, SC *conn)
+{
+	VALUE cache = rb_iv_get(self, IV_CACHE);
+
+	if(NIL_P(cache)) return;
+	sedna_cache_flush(cache);
+	if(SEtransactionStatus(conn) == SEDNA_TRANSACTION_ACTIVE) rb_iv_set(self, IV_CACHE_DIRTY, Qtrue);
+}
 
+// Flush the cache of the connection if the transaction that was just
+// finished performed any updates.
+static void sedna_cache_finished(VALUE self, int committed)
+{
+	VALUE cache = rb_iv_get(self, IV_CACHE);
+
+	if(!RTEST(rb_iv_get(self, IV_CACHE_DIRTY))) return;
+	rb_iv_set(self, IV_CACHE_DIRTY, Qfalse);
+	if(committed && !NIL_P(cache)) sedna_cache_flush(cache);
+}
 
 // Common functions =======================================================
 
-// Test the last error message for conn, and raise an exception if there is one.
-// The type of the exception is based on the result of the function that was
-// called that generated the error and should be passed as res.
-static void sedna_err(SC *conn, int res)
+#ifdef FIBER_SCHEDULER
+// Wait until the socket with file descriptor args[0] is ready for the events
+// in args[1], for at most args[2] seconds if it is not nil.
+static VALUE sedna_io_wait(VALUE *args)
 {
-	VALUE exc_class, exc;
-	const char *msg;
-	char *code, *err, *details, *p, exc_message[BUFSIZ];
+	VALUE io = rb_funcall(rb_cIO, rb_intern("for_fd"), 1, args[0]);
+	rb_funcall(io, rb_intern("autoclose="), 1, Qfalse);
+	return rb_io_wait(io, args[1], args[2]);
+}
 
-	switch(res) {
-		case SEDNA_AUTHENTICATION_FAILED:
-			exc_class = cSednaAuthError; break;
-		case SEDNA_OPEN_SESSION_FAILED:
-		case SEDNA_CLOSE_SESSION_FAILED:
-			exc_class = cSednaConnError; break;
-		case SEDNA_BEGIN_TRANSACTION_FAILED:
-		case SEDNA_ROLLBACK_TRANSACTION_FAILED:
-		case SEDNA_COMMIT_TRANSACTION_FAILED:
-			exc_class = cSednaTrnError; break;
-		case SEDNA_ERROR:
-		default:
-			exc_class = cSednaException;
+// Called by the driver whenever the socket of a connection in nonblocking mode
+// is not ready. The fiber scheduler suspends the current fiber until it is. If
+// an exception is raised in the meantime, the operation fails and the
+// exception is re-raised by sedna_err() when the driver has returned.
+static int sedna_wait_handler(void *conn, int for_write)
+{
+	int state, timeout = 0, length = 0;
+	VALUE ready, args[3];
+
+	SEgetConnectionAttr(conn, SEDNA_ATTR_SOCKET_TIMEOUT, (void *)&timeout, &length);
+	args[0] = INT2NUM(SEgetSocket(conn));
+	args[1] = INT2NUM(for_write ? RUBY_IO_WRITABLE : RUBY_IO_READABLE);
+	args[2] = timeout > 0 ? rb_float_new(timeout / 1000.0) : Qnil;
+
+	ready = rb_protect((void*)sedna_io_wait, (VALUE)args, &state);
+	if(state != 0) {
+		rb_thread_local_aset(rb_thread_current(), rb_intern(TL_WAIT_STATE), INT2FIX(state));
+		return -1;
 	}
+	return RTEST(ready) ? 0 : SEDNA_TIMED_OUT;
+}
+
+// Re-raise an exception that was raised while waiting for a socket in the
+// current fiber, if any.
+static void sedna_wait_reraise(void)
+{
+	ID id = rb_intern(TL_WAIT_STATE);
+	VALUE state = rb_thread_local_aref(rb_thread_current(), id);
+	if(!NIL_P(state)) {
+		rb_thread_local_aset(rb_thread_current(), id, Qnil);
+		rb_jump_tag(FIX2INT(state));
+	}
+}
+
+// Switch the connection to nonblocking mode if a fiber scheduler is active for
+// the current fiber, and back to blocking mode otherwise. Returns 1 if the
+// connection is in nonblocking mode. Operations in nonblocking mode must be
+// run while holding the global VM lock.
+static int sedna_nonblocking(SC *conn)
+{
+	int value = NIL_P(rb_fiber_scheduler_current()) ? SEDNA_NONBLOCKING_OFF : SEDNA_NONBLOCKING_ON;
+	SEsetConnectionAttr(conn, SEDNA_ATTR_NONBLOCKING, (void *)&value, sizeof(int));
+	return value == SEDNA_NONBLOCKING_ON;
+}
+#endif
+
+// Create an exception of class exc_class based on the last error message for
+// conn.
+static VALUE sedna_exc(SC *conn, VALUE exc_class)
+{
+	VALUE exc;
+	const char *msg;
+	char *code, *err, *details, *p, exc_message[BUFSIZ];
 
 	msg = SEgetLastErrorMsg(conn);
 	// SEgetLastErrorCode(conn) is useless, because it varies if the order of
@@ -180,7 +592,37 @@ static void sedna_err(SC *conn, int res)
 	if(code != NULL) {
 		rb_iv_set(exc, IV_EXC_CODE, rb_str_new2(code));
 	}
-	rb_exc_raise(exc);
+	return exc;
+}
+
+// Test the last error message for conn, and raise an exception if there is one.
+// The type of the exception is based on the result of the function that was
+// called that generated the error and should be passed as res.
+static void sedna_err(SC *conn, int res)
+{
+	VALUE exc_class;
+
+#ifdef FIBER_SCHEDULER
+	// Re-raise the exception that made the operation fail, if any.
+	sedna_wait_reraise();
+#endif
+
+	switch(res) {
+		case SEDNA_AUTHENTICATION_FAILED:
+			exc_class = cSednaAuthError; break;
+		case SEDNA_OPEN_SESSION_FAILED:
+		case SEDNA_CLOSE_SESSION_FAILED:
+			exc_class = cSednaConnError; break;
+		case SEDNA_BEGIN_TRANSACTION_FAILED:
+		case SEDNA_ROLLBACK_TRANSACTION_FAILED:
+		case SEDNA_COMMIT_TRANSACTION_FAILED:
+			exc_class = cSednaTrnError; break;
+		case SEDNA_ERROR:
+		default:
+			exc_class = cSednaException;
+	}
+
+	rb_exc_raise(sedna_exc(conn, exc_class));
 }
 
 // Retrieve the SednaConnection struct from the Ruby Sedna object obj.
@@ -195,14 +637,128 @@ static SC* sedna_struct(VALUE obj)
 // Called at GC.
 static void sedna_free(SC *conn)
 {
-	if(SEconnectionStatus(conn) != SEDNA_CONNECTION_CLOSED) SEclose(conn);
-	free(conn);
+	SEdestroyConnection(conn);
 }
 
 // Mark any references to other objects for Ruby GC (if any).
 static void sedna_mark(SC *conn)
 { /* Unused. */ }
 
+// Names of the events of the operations in enum se_trace_operation.
+static const char *sedna_trace_names[SE_TRACE_OPERATIONS] = {
+	"connect.sedna", "close.sedna", "begin.sedna", "commit.sedna", "rollback.sedna", "execute.sedna",
+	"execute_batch.sedna", "next.sedna", "get_data.sedna", "load_data.sedna", "end_load_data.sedna"
+};
+
+// Free the copied strings of all collected events.
+static void sedna_events_clear(SI *si)
+{
+	int i;
+
+	for(i = 0; i < si->count; i++) {
+		free(si->events[i].query);
+		free(si->events[i].doc_name);
+		free(si->events[i].col_name);
+	}
+	si->count = 0;
+}
+
+// Mark the instrumentation block for Ruby GC.
+static void sedna_instrument_mark(SI *si)
+{
+	rb_gc_mark(si->block);
+}
+
+// Free the instrumentation of a connection. Called at GC.
+static void sedna_instrument_free(SI *si)
+{
+	sedna_events_clear(si);
+	free(si->events);
+	xfree(si);
+}
+
+// Called by the driver at the end of each operation while instrumentation is
+// enabled. This may be called without the global VM lock, so the event is
+// only collected, with plain malloc(). Events for which there is no memory
+// are dropped.
+static void sedna_trace_end(void *handle, const struct se_trace_event *trace)
+{
+	SI *si = handle;
+	SIE *e, *events;
+	int i, size;
+	long length = 0;
+
+	if(si->count == si->size) {
+		size = si->size ? si->size * 2 : 16;
+		if((events = realloc(si->events, size * sizeof(SIE))) == NULL) return;
+		si->events = events;
+		si->size = size;
+	}
+
+	e = &si->events[si->count++];
+	e->trace = *trace;
+	e->trace.query_parts = NULL;
+	e->trace.query_lengths = NULL;
+	e->query = NULL;
+	e->query_length = 0;
+	e->doc_name = trace->doc_name ? strdup(trace->doc_name) : NULL;
+	e->col_name = trace->col_name ? strdup(trace->col_name) : NULL;
+
+	if(trace->query_parts == NULL) return;
+	for(i = 0; i < trace->query_count; i++) length += trace->query_lengths[i];
+	if((e->query = malloc(length + 1)) == NULL) return;
+	for(i = 0; i < trace->query_count; i++) {
+		memcpy(e->query + e->query_length, trace->query_parts[i], trace->query_lengths[i]);
+		e->query_length += trace->query_lengths[i];
+	}
+}
+
+static const struct se_trace_hooks sedna_trace_hooks = { NULL, sedna_trace_end };
+
+// Pass the events that were collected for a connection to its instrumentation
+// block. This is called after each driver operation, while holding the global
+// VM lock; without instrumentation it only tests whether hooks are set. All
+// events are converted before the block is called, because new events may be
+// collected while it runs.
+static void sedna_instrument(SC *conn)
+{
+	SI *si;
+	SIE *e;
+	VALUE events, payload, block;
+	long start, finish;
+	int i;
+
+	if(conn->trace_hooks == NULL) return;
+	si = conn->trace_handle;
+	if(si->count == 0) return;
+
+	block = si->block;
+	events = rb_ary_new2(si->count);
+	for(i = 0; i < si->count; i++) {
+		e = &si->events[i];
+		payload = rb_hash_new();
+		if(e->query != NULL) rb_hash_aset(payload, ID2SYM(rb_intern("query")), STR_UTF8(rb_str_new(e->query, e->query_length)));
+		if(e->doc_name != NULL) rb_hash_aset(payload, ID2SYM(rb_intern("document")), STR_UTF8(rb_str_new2(e->doc_name)));
+		if(e->col_name != NULL) rb_hash_aset(payload, ID2SYM(rb_intern("collection")), STR_UTF8(rb_str_new2(e->col_name)));
+		rb_hash_aset(payload, ID2SYM(rb_intern("result")), INT2NUM(e->trace.result));
+		rb_hash_aset(payload, ID2SYM(rb_intern("duration")), rb_float_new(e->trace.duration_usec / 1e6));
+		rb_hash_aset(payload, ID2SYM(rb_intern("bytes_sent")), LL2NUM(e->trace.bytes_sent));
+		rb_hash_aset(payload, ID2SYM(rb_intern("bytes_received")), LL2NUM(e->trace.bytes_received));
+
+		start = (long)(e->trace.start_usec / 1000000);
+		finish = (long)((e->trace.start_usec + e->trace.duration_usec) / 1000000);
+		rb_ary_push(events, rb_ary_new3(5, rb_str_new2(sedna_trace_names[e->trace.operation]),
+			rb_time_new(start, (long)(e->trace.start_usec % 1000000)),
+			rb_time_new(finish, (long)((e->trace.start_usec + e->trace.duration_usec) % 1000000)),
+			LONG2NUM(++si->id), payload));
+	}
+	sedna_events_clear(si);
+
+	for(i = 0; i < RARRAY_LEN(events); i++) {
+		rb_apply(block, rb_intern("call"), rb_ary_entry(events, i));
+	}
+}
+
 // Connect to the server.
 static int sedna_blocking_connect(SCA *c)
 {
@@ -212,13 +768,72 @@ static int sedna_blocking_connect(SCA *c)
 #ifdef NON_BLOCKING
 static int sedna_non_blocking_connect(SCA *c)
 {
-	return rb_thread_blocking_region((void*)sedna_blocking_connect, c, RUBY_UBF_IO, NULL);
+	// Let the fiber scheduler wait instead of releasing the global VM lock.
+	if(SEDNA_NONBLOCKING(c->conn)) return sedna_blocking_connect(c);
+	return SEDNA_WITHOUT_GVL(sedna_blocking_connect, c, RUBY_UBF_IO, NULL);
+}
+
+// Interrupt a blocking operation on the connection. Ruby does this for every
+// interrupt of the thread that runs it: when it is killed or has an exception
+// raised in it, but also when a signal is trapped or Thread#wakeup is called.
+// If the driver supports interrupt handlers, only its wait for the server is
+// interrupted, and sedna_interrupt_handler() decides whether the operation
+// fails. Otherwise the operation always fails, and the connection with it,
+// because it is not known how much of the reply has been received.
+static void sedna_unblock(void *conn)
+{
+	SEinterrupt(conn);
+}
+
+#if defined(HAVE_SESETINTERRUPTHANDLER) && defined(HAVE_RB_THREAD_CALL_WITH_GVL)
+static VALUE sedna_check_ints(VALUE unused)
+{
+	rb_thread_check_ints();
+	return Qnil;
+}
+
+// Run the pending interrupts of the current thread, such as trap handlers and
+// exceptions raised with Thread#raise, and store the state of the exception
+// that one of them raised, if any.
+static void *sedna_run_interrupts(void *state)
+{
+	rb_protect(sedna_check_ints, Qnil, (int *)state);
+	return NULL;
+}
+
+// Called by the driver while it waits for the server, if sedna_unblock() has
+// been called in the meantime. The operation only fails if an interrupt raises
+// an exception, which is re-raised by sedna_without_gvl() once the driver has
+// returned; after a trapped signal or Thread#wakeup it simply goes on.
+static int sedna_interrupt_handler(void *state)
+{
+	rb_thread_call_with_gvl(sedna_run_interrupts, state);
+	return *(int *)state;
 }
 #endif
 
-static void sedna_connect(VALUE self, SCA *c)
+// Run func(arg) for the connection without holding the global VM lock, so that
+// other threads can run while it waits for the server.
+static int sedna_without_gvl(SC *conn, void *func, void *arg)
+{
+#if defined(HAVE_SESETINTERRUPTHANDLER) && defined(HAVE_RB_THREAD_CALL_WITH_GVL)
+	int res, state = 0;
+	SEsetInterruptHandler(conn, sedna_interrupt_handler, &state);
+	res = SEDNA_WITHOUT_GVL(func, arg, sedna_unblock, conn);
+	SEsetInterruptHandler(conn, sedna_interrupt_handler, NULL);
+	if(state != 0) rb_jump_tag(state);
+	return res;
+#else
+	return SEDNA_WITHOUT_GVL(func, arg, sedna_unblock, conn);
+#endif
+}
+#endif
+
+// Try to connect to the server, and return the result.
+static int sedna_try_connect(VALUE self, SCA *c)
 {
 	int res = SEDNA_CONNECT(self, c);
+	sedna_instrument(c->conn);
 	if(res != SEDNA_SESSION_OPEN) {
 		// We have to set the connection status to closed explicitly here,
 		// because the GC routine sedna_free() will test for this status, but
@@ -227,8 +842,46 @@ static void sedna_connect(VALUE self, SCA *c)
 		// calling SEclose(), which will definitely lead to unpredictable
 		// results.
 		((SC*)c->conn)->isConnectionOk = SEDNA_CONNECTION_CLOSED;
-		sedna_err(c->conn, res);
 	}
+	return res;
+}
+
+static void sedna_connect(VALUE self, SCA *c)
+{
+	int res = sedna_try_connect(self, c);
+	if(res != SEDNA_SESSION_OPEN) sedna_err(c->conn, res);
+}
+
+// Wait before the next attempt to reconnect. The delay doubles with every
+// attempt, and a random part of it is taken, so that clients that lost their
+// connections at the same time do not all reconnect at the same time.
+static void sedna_reconnect_wait(double delay, int attempt)
+{
+	struct timeval tv;
+	double max = delay * pow(2, attempt - 1);
+
+	if(max > MAX_RECONNECT_DELAY) max = MAX_RECONNECT_DELAY;
+	delay = max * NUM2DBL(rb_funcall(rb_mKernel, rb_intern("rand"), 0));
+	tv.tv_sec = (long)delay;
+	tv.tv_usec = (long)((delay - tv.tv_sec) * 1e6);
+	rb_thread_wait_for(tv);
+}
+
+// Add a reconnect that took the given number of attempts and time in seconds
+// to the reconnect statistics of a connection.
+static void sedna_reconnect_count(VALUE self, int attempts, int failed, double elapsed)
+{
+	VALUE stats = rb_iv_get(self, IV_RECONNECT_STATS);
+	VALUE reconnects_k = ID2SYM(rb_intern("reconnects")), failures_k = ID2SYM(rb_intern("failures")),
+	      attempts_k = ID2SYM(rb_intern("attempts")), total_k = ID2SYM(rb_intern("total_time")),
+	      max_k = ID2SYM(rb_intern("max_time"));
+
+	rb_hash_aset(stats, reconnects_k, LONG2NUM(NUM2LONG(rb_hash_aref(stats, reconnects_k)) + 1));
+	if(failed) rb_hash_aset(stats, failures_k, LONG2NUM(NUM2LONG(rb_hash_aref(stats, failures_k)) + 1));
+	rb_hash_aset(stats, attempts_k, LONG2NUM(NUM2LONG(rb_hash_aref(stats, attempts_k)) + attempts));
+	rb_hash_aset(stats, total_k, rb_float_new(NUM2DBL(rb_hash_aref(stats, total_k)) + elapsed));
+	if(elapsed > NUM2DBL(rb_hash_aref(stats, max_k))) rb_hash_aset(stats, max_k, rb_float_new(elapsed));
+	rb_hash_aset(stats, ID2SYM(rb_intern("last_time")), rb_float_new(elapsed));
 }
 
 // Close the connection to the server.
@@ -237,114 +890,530 @@ static void sedna_close(SC *conn)
 	int res;
 	if(SEconnectionStatus(conn) != SEDNA_CONNECTION_CLOSED) {
 		res = SEclose(conn);
+		sedna_instrument(conn);
 		VERIFY_RES(SEDNA_SESSION_CLOSED, res, conn);
 	}
 }
 
-// Read one record completely and return it as a Ruby String object.
-static VALUE sedna_read(SC *conn, int strip_n)
+// Resize the Ruby String that is used as result buffer. The length of the
+// string is kept equal to the size of the buffer, so that all data that was
+// written to it so far is preserved.
+static void* sedna_resize_str(SR *r)
 {
-	int bytes_read = 0;
-	char buffer[RESULT_BUF_LEN];
-	VALUE str = rb_str_buf_new(0);
-	OBJ_TAINT(str);
-
-	do {
-		bytes_read = SEgetData(conn, buffer, RESULT_BUF_LEN - 1);
-		if(bytes_read == SEDNA_ERROR) {
-			sedna_err(conn, SEDNA_ERROR);
-		} else {
-			if(bytes_read > 0) {
-				if(strip_n) {
-					// Strange bug adds newlines to beginning of every result
-					// except the first. Strip them! This a known issue in the
-					// network protocol and serialization mechanism.
-					// See: http://sourceforge.net/mailarchive/forum.php?thread_name=3034886f0812030132v3bbd8e2erd86480d3dc640664%40mail.gmail.com&forum_name=sedna-discussion
-					STR_CAT(str, buffer + 1, bytes_read - 1);
-					// Do not strip newlines from subsequent buffer reads.
-					strip_n = 0;
-				} else {
-					STR_CAT(str, buffer, bytes_read);
-				}
-			}
-		}
-	} while(bytes_read > 0);
-
-	return str;
+	rb_str_resize(r->str, r->new_size);
+	return RSTRING_PTR(r->str);
 }
 
-// Iterate over all records and add them to a Ruby Array.
-static VALUE sedna_get_results(SC *conn)
+// Called by SEgetItemData() if the result buffer is too small. Strings can
+// only be resized while holding the global VM lock, so it is re-acquired if
+// the result is read without it.
+static char* sedna_resize_handler(void *r, char *buf, int used, int new_size)
 {
-	int res, strip_n = 0;
-	// Can be replaced with: rb_funcall(cSednaSet, rb_intern("new"), 0, NULL);
-	VALUE set = rb_ary_new();
+	((SR*)r)->new_size = new_size;
+#ifdef NON_BLOCKING_READ
+	if(!((SR*)r)->has_gvl) return rb_thread_call_with_gvl((void*)sedna_resize_str, r);
+#endif
+	return sedna_resize_str(r);
+}
 
-	while((res = SEnext(conn)) != SEDNA_RESULT_END) {
-		if(res == SEDNA_ERROR) sedna_err(conn, res);
-		// Set strip_n to 1 for all results except the first. This will cause
-		// sedna_read() an incorrect newline that is prepended to these results.
-		rb_ary_push(set, sedna_read(conn, strip_n));
-		if(!strip_n) strip_n = 1;
-	};
+// Move to the next record and read it completely. The data is read straight
+// into the buffer of the string r->str, which grows as necessary. Returns the
+// result of SEnext(), or SEDNA_ERROR if the data could not be read.
+static int sedna_blocking_read(SR *r)
+{
+	char newline;
+	int res = SEnext(r->conn);
+	if(res != SEDNA_NEXT_ITEM_SUCCEEDED) return res;
+
+	if(r->strip_n) {
+		// Strange bug adds newlines to beginning of every result
+		// except the first. Strip them! This a known issue in the
+		// network protocol and serialization mechanism.
+		// See: http://sourceforge.net/mailarchive/forum.php?thread_name=3034886f0812030132v3bbd8e2erd86480d3dc640664%40mail.gmail.com&forum_name=sedna-discussion
+		if(SEgetData(r->conn, &newline, 1) == SEDNA_ERROR) return SEDNA_ERROR;
+	}
 
-	return set;
+	r->bytes_read = SEgetItemData(r->conn, &r->buf, &r->buf_size, sedna_resize_handler, r);
+	return (r->bytes_read == SEDNA_ERROR) ? SEDNA_ERROR : res;
 }
 
-static int sedna_blocking_execute(SQ *q)
+#ifdef NON_BLOCKING_READ
+static int sedna_non_blocking_read(SR *r)
 {
-	return SEexecute(q->conn, q->query);
+	if((r->has_gvl = SEDNA_NONBLOCKING(r->conn))) return sedna_blocking_read(r);
+	return sedna_without_gvl(r->conn, sedna_blocking_read, r);
 }
+#endif
 
-#ifdef NON_BLOCKING
-static int sedna_non_blocking_execute(SQ *q)
+// Return the number of days between 1970-01-01 and the given date of the
+// proleptic Gregorian calendar.
+static long sedna_days_from_civil(long y, int m, int d)
 {
-	return rb_thread_blocking_region((void*)sedna_blocking_execute, q, RUBY_UBF_IO, NULL);
+	long era, yoe, doy;
+	y -= m <= 2;
+	era = (y >= 0 ? y : y - 399) / 400;
+	yoe = y - era * 400;
+	doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+	return era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
 }
-#endif
 
-// Enable or disable autocommit.
-static void sedna_autocommit(SC *conn, int value)
+// Parse exactly n digits at *s and advance *s. Returns -1 if there are none.
+static long sedna_parse_digits(const char **s, int n)
 {
-	int res = SEsetConnectionAttr(conn, SEDNA_ATTR_AUTOCOMMIT, (void *)&value, sizeof(int));
-	VERIFY_RES(SEDNA_SET_ATTRIBUTE_SUCCEEDED, res, conn);
+	long v = 0;
+	for(; n > 0; n--, (*s)++) {
+		if(**s < '0' || **s > '9') return -1;
+		v = v * 10 + (**s - '0');
+	}
+	return v;
 }
 
-// Begin a transaction.
-static void sedna_begin(SC *conn)
+// Convert the lexical form of an xs:dateTime or xs:date to a Time. Values
+// without a timezone are taken to be in UTC. Returns Qundef if the value
+// cannot be represented.
+static VALUE sedna_typed_time(const char *s, int with_time)
 {
-	int res;
+	long year, month, day, hour = 0, min = 0, sec = 0, nsec = 0, offset = 0, digits;
+	int negative = 0, utc = 1;
+	time_t t;
+
+	if(*s == '-') { negative = 1; s++; }
+	for(year = 0, digits = 0; *s >= '0' && *s <= '9' && digits < 9; s++, digits++) year = year * 10 + (*s - '0');
+	if(digits < 4 || *s++ != '-') return Qundef;
+	if(negative) year = -year;
+	if((month = sedna_parse_digits(&s, 2)) < 1 || month > 12 || *s++ != '-') return Qundef;
+	if((day = sedna_parse_digits(&s, 2)) < 1 || day > 31) return Qundef;
+
+	if(with_time) {
+		if(*s++ != 'T') return Qundef;
+		if((hour = sedna_parse_digits(&s, 2)) < 0 || hour > 24 || *s++ != ':') return Qundef;
+		if((min = sedna_parse_digits(&s, 2)) < 0 || min > 59 || *s++ != ':') return Qundef;
+		if((sec = sedna_parse_digits(&s, 2)) < 0 || sec > 59) return Qundef;
+		if(*s == '.') {
+			for(s++, digits = 0; *s >= '0' && *s <= '9'; s++, digits++) {
+				if(digits < 9) nsec = nsec * 10 + (*s - '0');
+			}
+			if(digits == 0) return Qundef;
+			for(; digits < 9; digits++) nsec *= 10;
+		}
+	}
 
-	// Disable autocommit mode.
-	SEDNA_AUTOCOMMIT_DISABLE(conn);
-	
-	// Start the transaction.
-	res = SEbegin(conn);
-	VERIFY_RES(SEDNA_BEGIN_TRANSACTION_SUCCEEDED, res, conn);
+	if(*s == 'Z') {
+		s++;
+	} else if(*s == '+' || *s == '-') {
+		negative = (*s++ == '-');
+		if((offset = sedna_parse_digits(&s, 2)) < 0 || offset > 14 || *s++ != ':') return Qundef;
+		if((digits = sedna_parse_digits(&s, 2)) < 0 || digits > 59) return Qundef;
+		offset = offset * 3600 + digits * 60;
+		if(negative) offset = -offset;
+		utc = 0;
+	}
+	if(*s != '\0') return Qundef;
+
+	t = (time_t)(sedna_days_from_civil(year, (int)month, (int)day) * 86400 + hour * 3600 + min * 60 + sec - offset);
+#ifdef HAVE_RB_TIME_TIMESPEC_NEW
+	{
+		struct timespec ts;
+		ts.tv_sec = t;
+		ts.tv_nsec = nsec;
+		// Keep the offset of the timezone of the value.
+		return rb_time_timespec_new(&ts, utc ? INT_MAX - 1 : (int)offset);
+	}
+#else
+	return rb_funcall(rb_time_nano_new(t, nsec), rb_intern("utc"), 0);
+#endif
 }
 
-// Commit a transaction.
-static void sedna_tr_commit(SC *conn)
+// Convert the lexical form of an xs:integer (or a type derived from it) to an
+// Integer. Returns Qundef if it is not valid.
+static VALUE sedna_typed_integer(const char *s, long len)
 {
-	int res;
+	const char *p = s;
+	if(*p == '+' || *p == '-') p++;
+	if(*p == '\0') return Qundef;
+	for(; *p != '\0'; p++) if(*p < '0' || *p > '9') return Qundef;
+
+	// Avoid the overhead of arbitrary precision for all but huge numbers.
+	if(len <= 18) return LL2NUM(strtoll(s, NULL, 10));
+	return rb_cstr_to_inum(s, 10, 0);
+}
 
-	if(SEtransactionStatus(conn) == SEDNA_TRANSACTION_ACTIVE) {
-		// Commit if a transaction was in progres.
-		res = SEcommit(conn);
-		VERIFY_RES(SEDNA_COMMIT_TRANSACTION_SUCCEEDED, res, conn);
-	} else {
-		// If there is no current transaction, raise an error.
-		rb_raise(cSednaTrnError, "No transaction in progress, cannot commit.");
+// Convert the record that was just read to the Ruby object that corresponds
+// to the type of the item if it is an atomic value of a numeric, boolean or
+// date type. The data is parsed straight from the read buffer. Returns Qundef
+// if the record should be returned as a string instead.
+static VALUE sedna_typed_record(SC *conn, SR *r)
+{
+	const char *s = r->buf;
+	char *end;
+	double d;
+
+	if(SEDNA_ITEM_CLASS(conn) != se_atomic || r->bytes_read >= r->buf_size) return Qundef;
+	r->buf[r->bytes_read] = '\0';
+
+	switch(SEDNA_ITEM_TYPE(conn)) {
+		case se_integer:
+		case se_nonPositiveInteger: case se_negativeInteger: case se_long: case se_int: case se_short: case se_byte:
+		case se_nonNegativeInteger: case se_unsignedLong: case se_unsignedInt: case se_unsignedShort: case se_unsignedByte:
+		case se_positiveInteger:
+			return sedna_typed_integer(s, r->bytes_read);
+		case se_float:
+		case se_double:
+			// Also parses INF, -INF and NaN.
+			d = strtod(s, &end);
+			return (end == s || *end != '\0') ? Qundef : rb_float_new(d);
+		case se_boolean:
+			if(strcmp(s, "true") == 0 || strcmp(s, "1") == 0) return Qtrue;
+			if(strcmp(s, "false") == 0 || strcmp(s, "0") == 0) return Qfalse;
+			return Qundef;
+		case se_dateTime:
+			return sedna_typed_time(s, 1);
+		case se_date:
+			return sedna_typed_time(s, 0);
+		default:
+			return Qundef;
 	}
 }
 
-// Commit a transaction and reset autocommit mode.
-static void sedna_commit(SC *conn, VALUE self)
+// Iterate over all records and pass each of them to func as soon as it has
+// been read, together with the given argument. If typed is set, atomic values
+// of numeric, boolean and date types are converted to the corresponding Ruby
+// objects, and the read buffer is reused for the next record.
+static void sedna_each_record(SC *conn, int typed, VALUE (*func)(VALUE, VALUE), VALUE arg)
 {
-	int status;
+	int res;
+	VALUE record;
+	SR r = { conn, Qnil, NULL, 0, 0, 0, 0, 1 };
+
+	while(1) {
+		if(NIL_P(r.str)) r.str = rb_str_new(NULL, RESULT_BUF_LEN);
+		r.buf = RSTRING_PTR(r.str);
+		r.buf_size = (int)RSTRING_LEN(r.str);
+
+		// Read the next record, without the global VM lock if possible.
+		res = SEDNA_READ(&r);
+		sedna_instrument(conn);
+		if(res == SEDNA_ERROR || res == SEDNA_NEXT_ITEM_FAILED) sedna_err(conn, res);
+		if(res != SEDNA_NEXT_ITEM_SUCCEEDED) break;
+
+		record = typed ? sedna_typed_record(conn, &r) : Qundef;
+		if(record == Qundef) {
+			// Truncate the string to the data that was actually read.
+			rb_str_resize(r.str, r.bytes_read);
+			OBJ_TAINT(r.str);
+			STR_UTF8(r.str);
+			record = r.str;
+			r.str = Qnil;
+		}
+		func(arg, record);
 
-	// Roll back.
+		// Set strip_n to 1 for all results except the first. This will cause
+		// sedna_blocking_read() to strip an incorrect newline that is
+		// prepended to these results.
+		r.strip_n = 1;
+	}
+}
+
+// Iterate over all records and add them to a Ruby Array.
+static VALUE sedna_get_results(SC *conn, int typed)
+{
+	// Can be replaced with: rb_funcall(cSednaSet, rb_intern("new"), 0, NULL);
+	VALUE set = rb_ary_new();
+	sedna_each_record(conn, typed, rb_ary_push, set);
+	return set;
+}
+
+// Yield a single record to the block that was given.
+static VALUE sedna_yield_record(VALUE unused, VALUE record)
+{
+	return rb_yield(record);
+}
+
+// Select the concurrency type of the transaction that is started implicitly
+// by the next statement in autocommit mode. The driver only contacts the
+// server if the type changes. This function does not need the global VM lock,
+// so it returns the result code of the driver instead of raising exceptions.
+static int sedna_concurrency(SC *conn, int read_only)
+{
+	int value = read_only ? SEDNA_READONLY_TRANSACTION : SEDNA_UPDATE_TRANSACTION;
+
+	// Changing the type would commit a transaction that is in progress.
+	if(SEtransactionStatus(conn) == SEDNA_TRANSACTION_ACTIVE) return SEDNA_SET_ATTRIBUTE_SUCCEEDED;
+	return SEsetConnectionAttr(conn, SEDNA_ATTR_CONCURRENCY_TYPE, (void *)&value, sizeof(int));
+}
+
+// Select the server-side timeout of the next statement. The driver sends it
+// together with the statement, and only if it changes. A timeout that was
+// given to a single query therefore stays in effect until a statement with
+// another timeout is executed, which saves a round-trip if the next query has
+// the same timeout. Like sedna_concurrency(), it returns the result code.
+static int sedna_timeout(SC *conn, int timeout)
+{
+	return SEsetConnectionAttr(conn, SEDNA_ATTR_QUERY_EXEC_TIMEOUT, (void *)&timeout, sizeof(int));
+}
+
+static int sedna_blocking_execute(SQ *q)
+{
+	int res = sedna_concurrency(q->conn, q->read_only);
+	if(res != SEDNA_SET_ATTRIBUTE_SUCCEEDED) return res;
+	res = sedna_timeout(q->conn, q->timeout);
+	if(res != SEDNA_SET_ATTRIBUTE_SUCCEEDED) return res;
+#ifdef HAVE_SEEXECUTEPARTS
+	if(q->parts != NULL) return SEexecuteParts(q->conn, q->parts, q->lengths, q->count);
+#endif
+	return SEexecute(q->conn, q->query);
+}
+
+#ifdef NON_BLOCKING
+static int sedna_non_blocking_execute(SQ *q)
+{
+	if(SEDNA_NONBLOCKING(q->conn)) return sedna_blocking_execute(q);
+	return sedna_without_gvl(q->conn, sedna_blocking_execute, q);
+}
+#endif
+
+static int sedna_blocking_execute_batch(SB *b)
+{
+	// Batches consist of updates, so they always run as update transactions.
+	int res = sedna_concurrency(b->conn, 0);
+	if(res != SEDNA_SET_ATTRIBUTE_SUCCEEDED) return res;
+	res = sedna_timeout(b->conn, b->timeout);
+	if(res != SEDNA_SET_ATTRIBUTE_SUCCEEDED) return res;
+	return SEexecuteBatch(b->conn, b->queries, b->count, b->results, &b->executed);
+}
+
+#ifdef NON_BLOCKING
+static int sedna_non_blocking_execute_batch(SB *b)
+{
+	if(SEDNA_NONBLOCKING(b->conn)) return sedna_blocking_execute_batch(b);
+	return sedna_without_gvl(b->conn, sedna_blocking_execute_batch, b);
+}
+#endif
+
+// Load the data in l->buf, or everything that can be read from l->fd, and
+// finish loading the document. If neither is given, the data has been loaded
+// already.
+static int sedna_blocking_load(SL *l)
+{
+	int res = sedna_concurrency(l->conn, 0);
+	if(res != SEDNA_SET_ATTRIBUTE_SUCCEEDED) return res;
+	res = sedna_timeout(l->conn, l->timeout);
+	if(res != SEDNA_SET_ATTRIBUTE_SUCCEEDED) return res;
+	res = SEDNA_DATA_CHUNK_LOADED;
+	if(l->buf != NULL) {
+		res = SEloadData(l->conn, l->buf, l->length, l->doc_name, l->col_name);
+	} else if(l->fd >= 0) {
+		res = SEloadFile(l->conn, l->fd, l->doc_name, l->col_name);
+	}
+	if(res != SEDNA_DATA_CHUNK_LOADED) return res;
+	return SEendLoadData(l->conn);
+}
+
+#ifdef NON_BLOCKING
+static int sedna_non_blocking_load(SL *l)
+{
+	if(SEDNA_NONBLOCKING(l->conn)) return sedna_blocking_load(l);
+	return sedna_without_gvl(l->conn, sedna_blocking_load, l);
+}
+#endif
+
+// Load a document while the string l->buf points to is locked, so that it
+// cannot be modified while it is read without the global VM lock.
+static VALUE sedna_load_locked(VALUE args)
+{
+	int res = SEDNA_LOAD(((VALUE*)args)[0], (SL*)((VALUE*)args)[1]);
+	return INT2NUM(res);
+}
+
+// Return the file descriptor of the IO object io if the driver can read the
+// document from it directly, or -1 if it has to be read through Ruby because
+// data has been buffered already.
+static int sedna_load_fd(VALUE io)
+{
+#ifdef LOAD_FROM_FD
+	rb_io_t *fptr;
+	GetOpenFile(io, fptr);
+	rb_io_check_readable(fptr);
+	if(rb_io_read_pending(fptr)) return -1;
+#ifdef HAVE_RB_IO_DESCRIPTOR
+	return rb_io_descriptor(io);
+#else
+	return fptr->fd;
+#endif
+#else
+	return -1;
+#endif
+}
+
+// Return whether the options of a query ask for results in SXML format.
+static int sedna_query_sxml(VALUE options)
+{
+	VALUE format;
+
+	if(NIL_P(options)) return 0;
+	Check_Type(options, T_HASH);
+	format = rb_hash_aref(options, ID2SYM(rb_intern("format")));
+
+	if(NIL_P(format) || format == ID2SYM(rb_intern("xml"))) return 0;
+	if(format != ID2SYM(rb_intern("sxml"))) rb_raise(rb_eArgError, "Result format must be :xml or :sxml.");
+#ifndef SEDNA_RESULT_FORMAT_SXML
+	rb_raise(rb_eNotImpError, "SXML results are not supported by the Sedna driver.");
+#endif
+	return 1;
+}
+
+// Select the result format of the next query. The driver only records it, so
+// this does not cause a network round-trip.
+static void sedna_result_format(SC *conn, int sxml)
+{
+#ifdef SEDNA_RESULT_FORMAT_SXML
+	int value = sxml ? SEDNA_RESULT_FORMAT_SXML : SEDNA_RESULT_FORMAT_XML;
+	int res = SEsetConnectionAttr(conn, SEDNA_ATTR_RESULT_FORMAT, (void *)&value, sizeof(int));
+	VERIFY_RES(SEDNA_SET_ATTRIBUTE_SUCCEEDED, res, conn);
+#endif
+}
+
+// Convert a timeout in seconds to whole seconds, rounding up; nil means no
+// timeout.
+static int sedna_timeout_seconds(VALUE timeout)
+{
+	double value;
+
+	if(NIL_P(timeout)) return 0;
+	value = NUM2DBL(timeout);
+	if(value < 0) rb_raise(rb_eArgError, "Timeout must not be negative.");
+	if(value > INT_MAX) rb_raise(rb_eArgError, "Timeout is too large.");
+	return (int)ceil(value);
+}
+
+// Return the server-side timeout in seconds of a statement: the one that is
+// given with the :timeout query option, if any, or that of the connection.
+static int sedna_query_timeout_option(VALUE self, VALUE options)
+{
+	VALUE timeout = rb_iv_get(self, IV_QUERY_TIMEOUT);
+
+	if(!NIL_P(options)) {
+		Check_Type(options, T_HASH);
+		if(rb_funcall(options, rb_intern("has_key?"), 1, ID2SYM(rb_intern("timeout"))) == Qtrue) {
+			return sedna_timeout_seconds(rb_hash_aref(options, ID2SYM(rb_intern("timeout"))));
+		}
+	}
+	return NIL_P(timeout) ? 0 : NUM2INT(timeout);
+}
+
+// Execute a query with the result format and timeout that it was given.
+static int sedna_execute_query(SQ *q)
+{
+	int res;
+
+	sedna_result_format(q->conn, q->sxml);
+	res = SEDNA_EXECUTE_UNLOCKED(q);
+	sedna_instrument(q->conn);
+	return res;
+}
+
+// Execute a query and return all results in an Array if it was a select query.
+// This function is called while holding the connection mutex, so that the
+// results cannot be mixed up with those of queries from other threads.
+static VALUE sedna_execute_results(SQ *q)
+{
+	int res;
+
+	res = sedna_execute_query(q);
+
+	switch(res) {
+		case SEDNA_QUERY_SUCCEEDED:
+			// Return the results if this was a query.
+			return sedna_get_results(q->conn, q->typed);
+		case SEDNA_UPDATE_SUCCEEDED:
+		case SEDNA_BULK_LOAD_SUCCEEDED:
+			// Return nil if this was an update or bulk load.
+			q->updated = 1;
+			return Qnil;
+		default:
+			// Raise an exception if something else happened.
+			sedna_err(q->conn, res);
+			return Qnil;
+	}
+}
+
+// Execute a query and yield each result to the given block as soon as it has
+// been read, instead of collecting all results first. Records that have been
+// processed by the block are not referenced anymore and can be garbage
+// collected. This function is called while holding the connection mutex, so
+// the mutex is held for the lifetime of the iteration.
+static VALUE sedna_stream_results(SQ *q)
+{
+	int res;
+
+	res = sedna_execute_query(q);
+
+	switch(res) {
+		case SEDNA_QUERY_SUCCEEDED:
+			// Yield the results if this was a query.
+			sedna_each_record(q->conn, q->typed, sedna_yield_record, Qnil);
+			return Qnil;
+		case SEDNA_UPDATE_SUCCEEDED:
+		case SEDNA_BULK_LOAD_SUCCEEDED:
+			q->updated = 1;
+			return Qnil;
+		default:
+			sedna_err(q->conn, res);
+			return Qnil;
+	}
+}
+
+// Enable or disable autocommit.
+static void sedna_autocommit(SC *conn, int value)
+{
+	int res = SEsetConnectionAttr(conn, SEDNA_ATTR_AUTOCOMMIT, (void *)&value, sizeof(int));
+	VERIFY_RES(SEDNA_SET_ATTRIBUTE_SUCCEEDED, res, conn);
+}
+
+// Begin a transaction, which is read-only if read_only is set.
+static void sedna_begin(SC *conn, int read_only)
+{
+	int res;
+
+	// Disable autocommit mode.
+	SEDNA_NONBLOCKING(conn);
+	SEDNA_AUTOCOMMIT_DISABLE(conn);
+
+	// Select the concurrency type before the transaction starts.
+	res = sedna_concurrency(conn, read_only);
+	VERIFY_RES(SEDNA_SET_ATTRIBUTE_SUCCEEDED, res, conn);
+	
+	// Start the transaction.
+	res = SEbegin(conn);
+	sedna_instrument(conn);
+	VERIFY_RES(SEDNA_BEGIN_TRANSACTION_SUCCEEDED, res, conn);
+}
+
+// Commit a transaction.
+static void sedna_tr_commit(SC *conn)
+{
+	int res;
+
+	if(SEtransactionStatus(conn) == SEDNA_TRANSACTION_ACTIVE) {
+		// Commit if a transaction was in progres.
+		SEDNA_NONBLOCKING(conn);
+		res = SEcommit(conn);
+		sedna_instrument(conn);
+		VERIFY_RES(SEDNA_COMMIT_TRANSACTION_SUCCEEDED, res, conn);
+	} else {
+		// If there is no current transaction, raise an error.
+		rb_raise(cSednaTrnError, "No transaction in progress, cannot commit.");
+	}
+}
+
+// Commit a transaction and reset autocommit mode.
+static void sedna_commit(SC *conn, VALUE self)
+{
+	int status;
+
+	// Roll back.
 	rb_protect((void*)sedna_tr_commit, (VALUE)conn, &status);
+	sedna_cache_finished(self, status == 0);
 
 	// Turn autocommit back on if it was set.
 	SWITCH_SEDNA_AUTOCOMMIT(conn, rb_iv_get(self, IV_AUTOCOMMIT));
@@ -360,7 +1429,9 @@ static void sedna_tr_rollback(SC *conn)
 	
 	// Roll back if a transaction was in progress.
 	if(SEtransactionStatus(conn) == SEDNA_TRANSACTION_ACTIVE) {
+		SEDNA_NONBLOCKING(conn);
 		res = SErollback(conn);
+		sedna_instrument(conn);
 		VERIFY_RES(SEDNA_ROLLBACK_TRANSACTION_SUCCEEDED, res, conn);
 	}
 }
@@ -372,6 +1443,7 @@ static void sedna_rollback(SC *conn, VALUE self)
 
 	// Roll back.
 	rb_protect((void*)sedna_tr_rollback, (VALUE)conn, &status);
+	sedna_cache_finished(self, 0);
 
 	// Turn autocommit back on if it was set.
 	SWITCH_SEDNA_AUTOCOMMIT(conn, rb_iv_get(self, IV_AUTOCOMMIT));
@@ -386,10 +1458,18 @@ static void sedna_rollback(SC *conn, VALUE self)
 // Alocates memory for a SednaConnection struct.
 static VALUE cSedna_s_new(VALUE klass)
 {
-	SC *conn, init = SEDNA_CONNECTION_INITIALIZER;
-	conn = ALLOC(SC);
+	int pipelined = SEDNA_PIPELINED_AUTOCOMMIT_ON;
+	SC *conn = SEcreateConnection();
 	if(conn == NULL) rb_raise(rb_eNoMemError, "Could not allocate memory.");
-	memcpy(conn, &init, sizeof(init));
+
+	// Send implicit begin and commit messages in autocommit mode together with
+	// the query, without waiting for each of them to be acknowledged.
+	SEsetConnectionAttr(conn, SEDNA_ATTR_PIPELINED_AUTOCOMMIT, (void *)&pipelined, sizeof(int));
+
+#ifdef FIBER_SCHEDULER
+	// Wait with the fiber scheduler when the connection is in nonblocking mode.
+	SEsetWaitHandler(conn, sedna_wait_handler, conn);
+#endif
 
 	return Data_Wrap_Struct(klass, sedna_mark, sedna_free, conn);
 }
@@ -402,8 +1482,10 @@ static VALUE cSedna_s_new(VALUE klass)
 static VALUE cSedna_initialize(VALUE self, VALUE options)
 {
 	VALUE host_k, db_k, user_k, pw_k,
-	      host_v, db_v, user_v, pw_v;
+	      host_v, db_v, user_v, pw_v,
+	      attempts_v, delay_v, timeout_v;
 	char *host, *db, *user, *pw;
+	int timeout;
 
 	// Ensure the argument is a Hash.
 	Check_Type(options, T_HASH);
@@ -431,6 +1513,24 @@ static VALUE cSedna_initialize(VALUE self, VALUE options)
 	rb_iv_set(self, IV_MUTEX, rb_mutex_new());
 #endif
 
+	// Save the reconnect options and clear the reconnect statistics.
+	attempts_v = rb_hash_aref(options, ID2SYM(rb_intern("reconnect_attempts")));
+	delay_v = rb_hash_aref(options, ID2SYM(rb_intern("reconnect_delay")));
+	timeout_v = rb_hash_aref(options, ID2SYM(rb_intern("connect_timeout")));
+	attempts_v = NIL_P(attempts_v) ? INT2NUM(DEFAULT_RECONNECT_ATTEMPTS) : INT2NUM(NUM2INT(attempts_v));
+	delay_v = rb_float_new(NIL_P(delay_v) ? DEFAULT_RECONNECT_DELAY : NUM2DBL(delay_v));
+	if(NUM2INT(attempts_v) < 1) rb_raise(rb_eArgError, "Number of reconnect attempts must be at least 1.");
+	if(!NIL_P(timeout_v) && NUM2DBL(timeout_v) < 0) rb_raise(rb_eArgError, "Connect timeout must not be negative.");
+	rb_iv_set(self, IV_RECONNECT_ATTEMPTS, attempts_v);
+	rb_iv_set(self, IV_RECONNECT_DELAY, delay_v);
+	rb_funcall(self, rb_intern("reconnect_stats_clear"), 0);
+
+	// Give up connecting after the connect timeout, if any.
+	if(!NIL_P(timeout_v)) {
+		timeout = (int)ceil(NUM2DBL(timeout_v) * 1000);
+		SEsetConnectionAttr(sedna_struct(self), SEDNA_ATTR_CONNECT_TIMEOUT, (void *)&timeout, sizeof(int));
+	}
+
 	// Connect to the database.
 	SCA c = { sedna_struct(self), host, db, user, pw };
 	sedna_connect(self, &c);
@@ -438,6 +1538,19 @@ static VALUE cSedna_initialize(VALUE self, VALUE options)
 	// Initialize @autocommit to true.
 	rb_iv_set(self, IV_AUTOCOMMIT, Qtrue);
 
+	// Return strings unless typed results were requested.
+	rb_iv_set(self, IV_TYPED, RTEST(rb_hash_aref(options, ID2SYM(rb_intern("typed_results")))) ? Qtrue : Qfalse);
+
+	// Run update transactions unless read-only transactions were requested.
+	rb_iv_set(self, IV_READ_ONLY, RTEST(rb_hash_aref(options, ID2SYM(rb_intern("read_only")))) ? Qtrue : Qfalse);
+
+	// Apply the query and socket timeouts, if any.
+	rb_funcall(self, rb_intern("query_timeout="), 1, rb_hash_aref(options, ID2SYM(rb_intern("query_timeout"))));
+	rb_funcall(self, rb_intern("socket_timeout="), 1, rb_hash_aref(options, ID2SYM(rb_intern("socket_timeout"))));
+
+	// Use the given result cache, if any.
+	rb_funcall(self, rb_intern("cache="), 1, rb_hash_aref(options, ID2SYM(rb_intern("cache"))));
+
 	return self;
 }
 
@@ -469,6 +1582,13 @@ static VALUE cSedna_close(VALUE self)
  * reconnecting, the same connection details are used that were given when initially
  * connecting with the connect method.
  *
+ * If the server cannot be reached, up to <tt>:reconnect_attempts</tt> attempts
+ * are made to reconnect (see Sedna.connect). The attempts are spread out over
+ * a random delay that doubles with every attempt, starting with
+ * <tt>:reconnect_delay</tt>, so that clients that lost their connections at the
+ * same time (because the server was restarted, for example) do not all
+ * reconnect at once. See Sedna#reconnect_stats for how long reconnecting takes.
+ *
  * If the connection could not be closed or reopened, a Sedna::ConnectionError is
  * raised. If the authentication fails when reconnecting, a
  * Sedna::AuthenticationError is raised.
@@ -477,6 +1597,8 @@ static VALUE cSedna_reset(VALUE self)
 {
 	VALUE host_v, db_v, user_v, pw_v;
 	SC *conn = sedna_struct(self);
+	int res, attempt, attempts = NUM2INT(rb_iv_get(self, IV_RECONNECT_ATTEMPTS));
+	double delay = NUM2DBL(rb_iv_get(self, IV_RECONNECT_DELAY)), started;
 	
 	// First ensure the current connection is closed.
 	sedna_close(conn);
@@ -489,13 +1611,210 @@ static VALUE cSedna_reset(VALUE self)
 
 	SCA c = { conn, StringValuePtr(host_v), StringValuePtr(db_v), StringValuePtr(user_v), StringValuePtr(pw_v) };
 	
-	// Connect to the database.
-	sedna_connect(self, &c);
+	// Connect to the database, trying again after a while if it fails. Failed
+	// authentication is not retried.
+	started = sedna_now();
+	for(attempt = 1; ; attempt++) {
+		res = sedna_try_connect(self, &c);
+		if(res == SEDNA_SESSION_OPEN || res == SEDNA_AUTHENTICATION_FAILED || attempt >= attempts) break;
+		sedna_reconnect_wait(delay, attempt);
+	}
+	sedna_reconnect_count(self, attempt, res != SEDNA_SESSION_OPEN, sedna_now() - started);
+	if(res != SEDNA_SESSION_OPEN) sedna_err(conn, res);
 
 	// Always return nil if successful.
 	return Qnil;
 }
 
+/*
+ * call-seq:
+ *   sedna.reconnect_stats -> hash
+ *
+ * Returns statistics of the reconnects of this connection with Sedna#reset
+ * (including those by a Sedna::Pool). The hash contains the number of
+ * <tt>:reconnects</tt>, how many of them <tt>:failures</tt> were, the number
+ * of connection <tt>:attempts</tt> made for them, and the <tt>:total_time</tt>,
+ * <tt>:average_time</tt>, <tt>:max_time</tt> and <tt>:last_time</tt> in
+ * seconds that reconnecting took, including the delays between attempts.
+ */
+static VALUE cSedna_reconnect_stats(VALUE self)
+{
+	VALUE stats = rb_hash_dup(rb_iv_get(self, IV_RECONNECT_STATS));
+	long reconnects = NUM2LONG(rb_hash_aref(stats, ID2SYM(rb_intern("reconnects"))));
+	double total = NUM2DBL(rb_hash_aref(stats, ID2SYM(rb_intern("total_time"))));
+
+	rb_hash_aset(stats, ID2SYM(rb_intern("average_time")), rb_float_new(reconnects ? total / reconnects : 0.0));
+	return stats;
+}
+
+/*
+ * call-seq:
+ *   sedna.reconnect_stats_clear -> nil
+ *
+ * Resets the statistics that are returned by Sedna#reconnect_stats.
+ */
+static VALUE cSedna_reconnect_stats_clear(VALUE self)
+{
+	VALUE stats = rb_hash_new();
+
+	rb_hash_aset(stats, ID2SYM(rb_intern("reconnects")), INT2FIX(0));
+	rb_hash_aset(stats, ID2SYM(rb_intern("failures")), INT2FIX(0));
+	rb_hash_aset(stats, ID2SYM(rb_intern("attempts")), INT2FIX(0));
+	rb_hash_aset(stats, ID2SYM(rb_intern("total_time")), rb_float_new(0.0));
+	rb_hash_aset(stats, ID2SYM(rb_intern("max_time")), rb_float_new(0.0));
+	rb_hash_aset(stats, ID2SYM(rb_intern("last_time")), rb_float_new(0.0));
+	rb_iv_set(self, IV_RECONNECT_STATS, stats);
+	return Qnil;
+}
+
+// Names of the kinds of requests in the order of enum se_stats_request.
+static const char *sedna_stats_requests[SE_STATS_REQUESTS] = {
+	"connect", "begin", "commit", "rollback", "execute", "next", "load", "options", "close", "other"
+};
+
+// Convert the round-trip statistics of a kind of request to a hash.
+static VALUE sedna_rtt_stats(const struct se_rtt_stats *rtt)
+{
+	VALUE stats = rb_hash_new(), histogram = rb_ary_new2(SE_STATS_BUCKETS);
+	int i;
+
+	for(i = 0; i < SE_STATS_BUCKETS; i++) rb_ary_push(histogram, LL2NUM(rtt->histogram[i]));
+	rb_hash_aset(stats, ID2SYM(rb_intern("count")), LL2NUM(rtt->count));
+	rb_hash_aset(stats, ID2SYM(rb_intern("total_time")), rb_float_new(rtt->total_usec / 1e6));
+	rb_hash_aset(stats, ID2SYM(rb_intern("average_time")), rb_float_new(rtt->count ? rtt->total_usec / 1e6 / rtt->count : 0.0));
+	rb_hash_aset(stats, ID2SYM(rb_intern("max_time")), rb_float_new(rtt->max_usec / 1e6));
+	rb_hash_aset(stats, ID2SYM(rb_intern("histogram")), histogram);
+	return stats;
+}
+
+/*
+ * call-seq:
+ *   sedna.stats -> hash
+ *
+ * Returns statistics of the traffic between this connection and the server,
+ * which are kept by the connection itself, so that no requests have to be
+ * sent to the server to collect them. The hash contains the number of
+ * <tt>:messages_sent</tt>, <tt>:bytes_sent</tt>, <tt>:messages_received</tt>
+ * and <tt>:bytes_received</tt>, the number of receives that had to wait for
+ * data (<tt>:recv_waits</tt>) and the <tt>:recv_wait_time</tt> in seconds
+ * they waited, the number of <tt>:commits</tt> and <tt>:rollbacks</tt>, and
+ * the number of <tt>:connects</tt> and <tt>:reconnects</tt>.
+ *
+ * The round-trip times of requests are kept separately for each kind of
+ * request in <tt>:round_trips</tt>: <tt>:connect</tt>, <tt>:begin</tt>,
+ * <tt>:commit</tt>, <tt>:rollback</tt>, <tt>:execute</tt>, <tt>:next</tt>
+ * (for results that are requested item by item), <tt>:load</tt>,
+ * <tt>:options</tt> (for session options), <tt>:close</tt> and
+ * <tt>:other</tt>. Each of them contains the <tt>:count</tt>,
+ * <tt>:total_time</tt>, <tt>:average_time</tt> and <tt>:max_time</tt> in
+ * seconds, and a <tt>:histogram</tt> array. Its first element counts the
+ * round-trips of less than a microsecond, the element at index +i+ those of
+ * at least 2**(i-1) and less than 2**i microseconds, and the last one all
+ * longer round-trips as well.
+ *
+ * Statistics are kept since the connection was created, including those of
+ * reconnects. Use Sedna#stats_clear to start counting from zero.
+ *
+ *   sedna.stats[:round_trips][:execute][:average_time]  #=> 0.00041
+ */
+static VALUE cSedna_stats(VALUE self)
+{
+	struct se_stats stats;
+	VALUE hash = rb_hash_new(), round_trips = rb_hash_new();
+	int i;
+
+	SEgetStats(sedna_struct(self), &stats);
+	rb_hash_aset(hash, ID2SYM(rb_intern("messages_sent")), LL2NUM(stats.messages_sent));
+	rb_hash_aset(hash, ID2SYM(rb_intern("bytes_sent")), LL2NUM(stats.bytes_sent));
+	rb_hash_aset(hash, ID2SYM(rb_intern("messages_received")), LL2NUM(stats.messages_received));
+	rb_hash_aset(hash, ID2SYM(rb_intern("bytes_received")), LL2NUM(stats.bytes_received));
+	rb_hash_aset(hash, ID2SYM(rb_intern("recv_waits")), LL2NUM(stats.recv_waits));
+	rb_hash_aset(hash, ID2SYM(rb_intern("recv_wait_time")), rb_float_new(stats.recv_wait_usec / 1e6));
+	rb_hash_aset(hash, ID2SYM(rb_intern("commits")), LL2NUM(stats.commits));
+	rb_hash_aset(hash, ID2SYM(rb_intern("rollbacks")), LL2NUM(stats.rollbacks));
+	rb_hash_aset(hash, ID2SYM(rb_intern("connects")), LL2NUM(stats.connects));
+	rb_hash_aset(hash, ID2SYM(rb_intern("reconnects")), LL2NUM(stats.reconnects));
+	for(i = 0; i < SE_STATS_REQUESTS; i++) {
+		rb_hash_aset(round_trips, ID2SYM(rb_intern(sedna_stats_requests[i])), sedna_rtt_stats(&stats.rtt[i]));
+	}
+	rb_hash_aset(hash, ID2SYM(rb_intern("round_trips")), round_trips);
+	return hash;
+}
+
+/*
+ * call-seq:
+ *   sedna.stats_clear -> nil
+ *
+ * Resets the statistics that are returned by Sedna#stats.
+ */
+static VALUE cSedna_stats_clear(VALUE self)
+{
+	SEresetStats(sedna_struct(self));
+	return Qnil;
+}
+
+/*
+ * call-seq:
+ *   sedna.instrument {|name, start, finish, id, payload| ... } -> nil
+ *   sedna.instrument -> nil
+ *
+ * Calls the given block for every operation of the driver on this connection,
+ * with the same arguments as the subscribers of ActiveSupport::Notifications,
+ * so that database calls can be traced. Without a block, instrumentation is
+ * disabled again. Each operation is reported as soon as it has finished.
+ *
+ * The name of an event is one of <tt>"connect.sedna"</tt>,
+ * <tt>"close.sedna"</tt>, <tt>"begin.sedna"</tt>, <tt>"commit.sedna"</tt>,
+ * <tt>"rollback.sedna"</tt>, <tt>"execute.sedna"</tt>,
+ * <tt>"execute_batch.sedna"</tt>, <tt>"next.sedna"</tt> (moving to the next
+ * result), <tt>"get_data.sedna"</tt> (reading a result),
+ * <tt>"load_data.sedna"</tt> and <tt>"end_load_data.sedna"</tt>. The start
+ * and finish are Time objects, and the id is a number that is increased for
+ * every event of the connection. The payload contains the <tt>:result</tt>
+ * code of the driver, the <tt>:duration</tt> in seconds, and the number of
+ * <tt>:bytes_sent</tt> and <tt>:bytes_received</tt> during the operation. The
+ * payload of queries contains the <tt>:query</tt>, and that of loads the
+ * <tt>:document</tt> and <tt>:collection</tt> (if any).
+ *
+ * Queries that are answered by a result cache (see Sedna#cache=) do not reach
+ * the driver, and are not reported. The block should not use the connection
+ * itself.
+ *
+ *   sedna.instrument do |*args|
+ *     ActiveSupport::Notifications.publish(*args)
+ *   end
+ */
+static VALUE cSedna_instrument(VALUE self)
+{
+	SC *conn = sedna_struct(self);
+	VALUE instrument = rb_iv_get(self, IV_INSTRUMENT);
+	SI *si;
+
+	if(!rb_block_given_p()) {
+		// Remove the hooks and discard events that were not reported yet.
+		SEsetTraceHooks(conn, NULL, NULL);
+		if(!NIL_P(instrument)) {
+			Data_Get_Struct(instrument, SI, si);
+			sedna_events_clear(si);
+			si->block = Qnil;
+		}
+		return Qnil;
+	}
+
+	if(NIL_P(instrument)) {
+		si = ALLOC(SI);
+		memset(si, 0, sizeof(SI));
+		si->block = Qnil;
+		instrument = Data_Wrap_Struct(rb_cObject, sedna_instrument_mark, sedna_instrument_free, si);
+		rb_iv_set(self, IV_INSTRUMENT, instrument);
+	} else {
+		Data_Get_Struct(instrument, SI, si);
+	}
+	si->block = rb_block_proc();
+	SEsetTraceHooks(conn, &sedna_trace_hooks, si);
+	return Qnil;
+}
+
 /*
  * call-seq:
  *   Sedna.connect(details) -> Sedna instance
@@ -524,6 +1843,26 @@ static VALUE cSedna_reset(VALUE self)
  * * <tt>:database</tt> - Name of the database to connect to (defaults to +test+).
  * * <tt>:username</tt> - User name to authenticate with (defaults to +SYSTEM+).
  * * <tt>:password</tt> - Password to authenticate with (defaults to +MANAGER+).
+ * * <tt>:typed_results</tt> - Whether to return atomic query results as Ruby
+ *   objects of the corresponding type (defaults to +false+). See
+ *   Sedna#typed_results.
+ * * <tt>:cache</tt> - A Sedna::Cache in which the results of queries are
+ *   cached (defaults to +nil+). See Sedna#cache.
+ * * <tt>:read_only</tt> - Whether queries and transactions run as read-only
+ *   transactions (defaults to +false+). See Sedna#read_only.
+ * * <tt>:connect_timeout</tt> - Number of seconds after which connecting to
+ *   the server fails if it does not respond (defaults to +nil+, which waits as
+ *   long as the operating system does).
+ * * <tt>:query_timeout</tt> - Number of seconds after which the server
+ *   aborts queries (defaults to +nil+, no timeout). See Sedna#query_timeout.
+ * * <tt>:socket_timeout</tt> - Number of seconds after which the connection
+ *   fails if the server does not respond (defaults to +nil+, no timeout). See
+ *   Sedna#socket_timeout.
+ * * <tt>:reconnect_attempts</tt> - Number of attempts Sedna#reset makes to
+ *   reconnect (defaults to 1).
+ * * <tt>:reconnect_delay</tt> - Number of seconds up to which Sedna#reset
+ *   waits before the second attempt to reconnect (defaults to 0.1). The delay
+ *   doubles for every further attempt.
  *
  * ==== Examples
  *
@@ -585,12 +1924,41 @@ static VALUE cSedna_s_version(VALUE klass)
  * queries can be run or multiple connections can be made simultaneously in
  * different threads. \Sedna will not block other threads (this method returns
  * +false+) when compiled against Ruby 1.9.1+.
+ *
+ * In Ruby 3.0+, connections that are used by a non-blocking fiber (with a
+ * fiber scheduler such as the one of the +async+ gem) do not block the thread
+ * either. Instead, the fiber scheduler runs other fibers while the connection
+ * waits for the server.
  */
 static VALUE cSedna_s_blocking(VALUE klass)
 {
 	return SEDNA_BLOCKING;
 }
 
+/*
+ * call-seq:
+ *   sedna.protocol_version -> string or nil
+ *
+ * Returns the version of the client protocol that is used by this connection,
+ * or +nil+ if the connection is closed. The newest version that is supported
+ * by both the client (see Sedna.version) and the server is used.
+ */
+static VALUE cSedna_protocol_version(VALUE self)
+{
+#ifdef HAVE_SEGETPROTOCOLVERSION
+	int major, minor;
+	char version[16];
+
+	SEgetProtocolVersion(sedna_struct(self), &major, &minor);
+	if(major == 0) return Qnil;
+	snprintf(version, sizeof(version), "%d.%d", major, minor);
+	return rb_str_new2(version);
+#else
+	if(SEconnectionStatus(sedna_struct(self)) == SEDNA_CONNECTION_CLOSED) return Qnil;
+	return rb_str_new2(PROTOCOL_VERSION);
+#endif
+}
+
 /*
  * call-seq:
  *   sedna.connected? -> true or false
@@ -609,25 +1977,95 @@ static VALUE cSedna_connected(VALUE self)
 
 /*
  * call-seq:
- *   sedna.execute(query) -> array or nil
- *   sedna.query(query) -> array or nil
+ *   sedna.each_result(query, options = {}) {|result| ... } -> nil
+ *   sedna.each_result(query, options = {}) -> enumerator
  *
- * Executes the given +query+ against a \Sedna database. Returns an array if the
- * given query is a select query. The elements of the array are strings that
- * correspond to each result in the result set. If the query is an update query
- * or a (bulk) load query, +nil+ is returned. When attempting to execute a
- * query on a closed connection, a Sedna::ConnectionError will be raised. A
- * Sedna::Exception is raised if the query fails or is invalid.
+ * Executes the given +query+ against a \Sedna database and yields each result
+ * as a string as soon as it has been received. Unlike Sedna#execute, the
+ * results are never collected in an array. This allows very large result sets
+ * to be processed without keeping all of them in memory. If the query is an
+ * update query or a (bulk) load query, the block is not called. If no block
+ * is given, an Enumerator is returned instead.
  *
- * This method does not block other threads in Ruby 1.9.1+ -- database queries that
- * are run in different threads with different connections will run concurrently.
- * You can use Sedna.blocking? to verify if the extension supports non-blocking
- * behaviour. Database queries run from different threads, but on the same
- * connection will still block and be executed serially.
+ * The connection is locked for the entire duration of the iteration. Queries
+ * on the same connection from other threads will wait until the iteration
+ * has completed. Executing other queries on the same connection from inside
+ * the block is not possible. If the iteration is ended prematurely, for
+ * example with +break+, the remaining results are discarded.
+ *
+ * The same options as for Sedna#execute are accepted.
  *
  * ==== Examples
  *
- * Create a new document.
+ * Process all articles of a large collection one by one.
+ *
+ *   sedna.each_result "collection('articles')/article" do |article|
+ *     # Process the article.
+ *   end
+ */
+static VALUE cSedna_each_result(int argc, VALUE *argv, VALUE self)
+{
+	SC *conn = sedna_struct(self);
+	VALUE query, options;
+
+#ifdef RETURN_ENUMERATOR
+	// Return an enumerator if no block is given.
+	RETURN_ENUMERATOR(self, argc, argv);
+#endif
+
+	// 1 mandatory argument, 1 optional.
+	rb_scan_args(argc, argv, "11", &query, &options);
+
+	// Prepare query arguments.
+	SQ q = { conn, StringValuePtr(query), RTEST(rb_iv_get(self, IV_TYPED)), sedna_query_sxml(options) };
+	q.read_only = RTEST(rb_iv_get(self, IV_READ_ONLY));
+	q.timeout = sedna_query_timeout_option(self, options);
+
+	// Verify that the connection is OK.
+	if(SEconnectionStatus(conn) != SEDNA_CONNECTION_OK) rb_raise(cSednaConnError, "Connection is closed.");
+
+	// Execute the query and yield all results while holding the lock.
+	SEDNA_SYNCHRONIZE(self, sedna_stream_results, &q);
+	if(q.updated) sedna_cache_updated(self, conn);
+
+	// Always return nil if successful.
+	return Qnil;
+}
+
+/*
+ * call-seq:
+ *   sedna.execute(query, options = {}) -> array or nil
+ *   sedna.execute(query, options = {}) {|result| ... } -> nil
+ *   sedna.query(query, options = {}) -> array or nil
+ *
+ * Executes the given +query+ against a \Sedna database. Returns an array if the
+ * given query is a select query. The elements of the array are strings that
+ * correspond to each result in the result set. If the query is an update query
+ * or a (bulk) load query, +nil+ is returned. When attempting to execute a
+ * query on a closed connection, a Sedna::ConnectionError will be raised. A
+ * Sedna::Exception is raised if the query fails or is invalid.
+ *
+ * If a block is given, each result is yielded as soon as it has been received
+ * from the database, and +nil+ is returned. See Sedna#each_result.
+ *
+ * This method does not block other threads in Ruby 1.9.1+ -- database queries that
+ * are run in different threads with different connections will run concurrently.
+ * You can use Sedna.blocking? to verify if the extension supports non-blocking
+ * behaviour. Database queries run from different threads, but on the same
+ * connection will still block and be executed serially.
+ *
+ * ==== Valid options
+ *
+ * * <tt>:format</tt> - The format in which the server serializes the results,
+ *   either <tt>:xml</tt> (default) or <tt>:sxml</tt>. SXML represents XML as
+ *   S-expressions, which are more compact and cheaper to parse.
+ * * <tt>:timeout</tt> - Number of seconds after which the server aborts the
+ *   query (rounded up to whole seconds), instead of Sedna#query_timeout.
+ *   +nil+ runs the query without a timeout.
+ *
+ * ==== Examples
+ *
+ * Create a new document.
  *
  *   sedna.execute "create document 'mydoc'"
  *     #=> nil
@@ -642,35 +2080,160 @@ static VALUE cSedna_connected(VALUE self)
  *   sedna.execute "doc('mydoc')/message/text()"
  *     #=> ["Hello world!"]
  *
+ * Select the same node in SXML format.
+ *
+ *   sedna.execute "doc('mydoc')/message", :format => :sxml
+ *     #=> ["(message \"Hello world!\")"]
+ *
  * ==== Further reading
  *
  * For more information about \Sedna's database query syntax and support, see the
  * <i>Database language</i> section of the official documentation of the
  * \Sedna project at http://modis.ispras.ru/sedna/progguide/ProgGuidese2.html
  */
-static VALUE cSedna_execute(VALUE self, VALUE query)
+static VALUE cSedna_execute(int argc, VALUE *argv, VALUE self)
 {
 	SC *conn = sedna_struct(self);
+	VALUE query, options, key, result;
+	long generation = 0;
+
+	// Stream the results if a block is given.
+	if(rb_block_given_p()) return cSedna_each_result(argc, argv, self);
+
+	// 1 mandatory argument, 1 optional.
+	rb_scan_args(argc, argv, "11", &query, &options);
 
 	// Prepare query arguments.
-	SQ q = { conn, StringValuePtr(query) };
+	SQ q = { conn, StringValuePtr(query), RTEST(rb_iv_get(self, IV_TYPED)), sedna_query_sxml(options) };
+	q.read_only = RTEST(rb_iv_get(self, IV_READ_ONLY));
+	q.timeout = sedna_query_timeout_option(self, options);
 
 	// Verify that the connection is OK.
 	if(SEconnectionStatus(conn) != SEDNA_CONNECTION_OK) rb_raise(cSednaConnError, "Connection is closed.");
+
+	// Return cached results if there are any.
+	if(!NIL_P(key = sedna_cache_key(self, conn, &q, query))) {
+		generation = sedna_cache_struct(rb_iv_get(self, IV_CACHE))->generation;
+		if((result = sedna_cache_get(rb_iv_get(self, IV_CACHE), key)) != Qundef) return result;
+	}
 	
-	// Execute query.
-	int res = SEDNA_EXECUTE(self, &q);
+	// Execute query and read all results while holding the lock.
+	result = SEDNA_SYNCHRONIZE(self, sedna_execute_results, &q);
+
+	if(q.updated) {
+		sedna_cache_updated(self, conn);
+	} else if(!NIL_P(key) && !NIL_P(result)) {
+		sedna_cache_put(rb_iv_get(self, IV_CACHE), key, result, generation);
+	}
+	return result;
+}
+
+// Execute the batch of queries in args[2] with the arguments in args[1], and
+// return the outcome of each statement that was executed. The result of the
+// driver is stored in args[3].
+static VALUE sedna_batch_outcomes(VALUE ptr)
+{
+	VALUE *args = (VALUE*)ptr;
+	SB *b = (SB*)args[1];
+	VALUE outcomes;
+	int i, res;
+
+	b->queries = ALLOC_N(const char*, b->count + 1);
+	b->results = ALLOC_N(int, b->count + 1);
+	for(i = 0; i < b->count; i++) b->queries[i] = RSTRING_PTR(rb_ary_entry(args[2], i));
+
+	res = SEDNA_EXECUTE_BATCH(args[0], b);
+	args[3] = INT2NUM(res);
+	sedna_instrument(b->conn);
+
+	outcomes = rb_ary_new2(b->executed);
+	for(i = 0; i < b->executed; i++) {
+		rb_ary_push(outcomes, ID2SYM(rb_intern(b->results[i] == SEDNA_QUERY_SUCCEEDED ? "query" : "update")));
+	}
+	return outcomes;
+}
+
+// Free the arguments of a batch.
+static VALUE sedna_batch_free(VALUE ptr)
+{
+	SB *b = (SB*)ptr;
+
+	xfree(b->queries);
+	xfree(b->results);
+	return Qnil;
+}
+
+/*
+ * call-seq:
+ *   sedna.execute_batch(queries) -> array
+ *
+ * Executes all queries in the array +queries+ against a \Sedna database in a
+ * single transaction. The queries are sent to the database in quick
+ * succession, without waiting for the result of each query before sending the
+ * next one. This is much faster than calling Sedna#execute for every query if
+ * many small queries, such as a series of updates, have to be executed.
+ *
+ * Returns an array with the outcome of each query: +:update+ for update
+ * queries and +:query+ for select queries. The results of select queries are
+ * discarded. Bulk load queries are not supported.
+ *
+ * Execution stops at the first query that fails, and a Sedna::BatchError is
+ * raised. Its +index+ attribute holds the position of the failed query in
+ * +queries+. Any queries that were already executed are rolled back. In
+ * autocommit mode, the queries are committed if all of them succeed. If
+ * called inside a transaction, the queries become part of it instead.
+ *
+ * ==== Examples
+ *
+ * Insert a number of messages at once.
+ *
+ *   sedna.execute_batch [
+ *     "update insert <message>Hello</message> into doc('mydoc')/messages",
+ *     "update insert <message>world!</message> into doc('mydoc')/messages"
+ *   ]
+ *     #=> [:update, :update]
+ */
+static VALUE cSedna_execute_batch(VALUE self, VALUE queries)
+{
+	int i, res;
+	VALUE strs, outcomes, exc, args[4];
+	SC *conn = sedna_struct(self);
+
+	// Ensure the argument is an Array.
+	Check_Type(queries, T_ARRAY);
+
+	// Copy the queries, so they cannot be changed while they are executed.
+	strs = rb_ary_new2(RARRAY_LEN(queries));
+	for(i = 0; i < RARRAY_LEN(queries); i++) {
+		VALUE query = rb_ary_entry(queries, i);
+		StringValue(query);
+		rb_ary_push(strs, rb_str_new(RSTRING_PTR(query), RSTRING_LEN(query)));
+	}
+
+	// Verify that the connection is OK.
+	if(SEconnectionStatus(conn) != SEDNA_CONNECTION_OK) rb_raise(cSednaConnError, "Connection is closed.");
+
+	// Execute all queries. The batch arguments are freed even if an exception
+	// is raised meanwhile.
+	SB b = { conn, NULL, RARRAY_LEN(strs), NULL, 0, sedna_query_timeout_option(self, Qnil) };
+	args[0] = self;
+	args[1] = (VALUE)&b;
+	args[2] = strs;
+	outcomes = rb_ensure(sedna_batch_outcomes, (VALUE)args, sedna_batch_free, (VALUE)&b);
+	res = NUM2INT(args[3]);
+	RB_GC_GUARD(strs);
 
 	switch(res) {
-		case SEDNA_QUERY_SUCCEEDED:
-			// Return the results if this was a query.
-			return sedna_get_results(conn);
-		case SEDNA_UPDATE_SUCCEEDED:
-		case SEDNA_BULK_LOAD_SUCCEEDED:
-			// Return nil if this was an update or bulk load.
+		case SEDNA_BATCH_SUCCEEDED:
+			if(rb_ary_includes(outcomes, ID2SYM(rb_intern("update"))) == Qtrue) sedna_cache_updated(self, conn);
+			return outcomes;
+		case SEDNA_BATCH_FAILED:
+			// Raise an exception that tells which query failed.
+			exc = sedna_exc(conn, cSednaBatchError);
+			rb_iv_set(exc, IV_EXC_INDEX, INT2NUM(b.executed));
+			rb_exc_raise(exc);
 			return Qnil;
 		default:
-			// Raise an exception if something else happened.
 			sedna_err(conn, res);
 			return Qnil;
 	}
@@ -689,6 +2252,10 @@ static VALUE cSedna_execute(VALUE self, VALUE query)
  * If the document was successfully loaded, this method returns +nil+. If an
  * error occurs, a Sedna::Exception is raised.
  *
+ * IO objects are read directly from their file descriptor, without holding
+ * the global VM lock, and regular files are mapped into memory instead of
+ * being read. This is the fastest way to load large documents.
+ *
  * ==== Examples
  *
  * Create a new document and retrieve its contents.
@@ -708,7 +2275,8 @@ static VALUE cSedna_load_document(int argc, VALUE *argv, VALUE self)
 {
 	int res = 0;
 	SC *conn = sedna_struct(self);
-	VALUE document, doc_name, col_name, buf;
+	SL l;
+	VALUE document, doc_name, col_name, buf, args[2];
 	char *doc_name_c, *col_name_c;
 
 	// Verify that the connection is OK.
@@ -719,16 +2287,41 @@ static VALUE cSedna_load_document(int argc, VALUE *argv, VALUE self)
 	doc_name_c = StringValuePtr(doc_name);
 	col_name_c = NIL_P(col_name) ? NULL : StringValuePtr(col_name);
 
-	if(TYPE(document) == T_FILE) {
+	l.conn = conn;
+	l.buf = NULL;
+	l.length = 0;
+	l.fd = -1;
+	l.doc_name = doc_name_c;
+	l.col_name = col_name_c;
+	l.timeout = sedna_query_timeout_option(self, Qnil);
+
+	// Fibers with a scheduler read IO objects through Ruby, so that they do
+	// not block other fibers.
+	if(TYPE(document) == T_FILE && !SEDNA_NONBLOCKING(conn) && (l.fd = sedna_load_fd(document)) >= 0) {
+		// If the document is an IO object without buffered data, let the
+		// driver load everything from its file descriptor.
+		res = SEDNA_LOAD(self, &l);
+	} else if(TYPE(document) == T_FILE) {
+		// Loading starts an update transaction in autocommit mode.
+		res = sedna_concurrency(conn, 0);
+		VERIFY_RES(SEDNA_SET_ATTRIBUTE_SUCCEEDED, res, conn);
+		res = sedna_timeout(conn, l.timeout);
+		VERIFY_RES(SEDNA_SET_ATTRIBUTE_SUCCEEDED, res, conn);
+		res = 0;
+
 		// If the document is an IO object...
 		while(!NIL_P(buf = rb_funcall(document, rb_intern("read"), 1, INT2NUM(LOAD_BUF_LEN)))) {
 			// ...read from it until we reach EOF and load the data.
 			res = SEloadData(conn, StringValuePtr(buf), RSTRING_LEN(buf), doc_name_c, col_name_c);
+			sedna_instrument(conn);
 			VERIFY_RES(SEDNA_DATA_CHUNK_LOADED, res, conn);
 		}
 
 		// If there is no data, raise an exception.
 		if(res == 0) rb_raise(cSednaException, "Document is empty.");
+
+		// Signal that we're finished.
+		res = SEDNA_LOAD(self, &l);
 	} else {
 		// If the document is not an IO object, verify it is a string instead.
 		Check_Type(document, T_STRING);
@@ -736,14 +2329,20 @@ static VALUE cSedna_load_document(int argc, VALUE *argv, VALUE self)
 		// If there is no data, raise an exception.
 		if(RSTRING_LEN(document) == 0) rb_raise(cSednaException, "Document is empty.");
 
-		// Load the data.
-		res = SEloadData(conn, StringValuePtr(document), RSTRING_LEN(document), doc_name_c, col_name_c);
-		VERIFY_RES(SEDNA_DATA_CHUNK_LOADED, res, conn);
+		// Load the data and signal that we're finished.
+		args[0] = self;
+		args[1] = (VALUE)&l;
+		l.buf = RSTRING_PTR(document);
+		l.length = RSTRING_LEN(document);
+		rb_str_locktmp(document);
+		res = NUM2INT(rb_ensure(sedna_load_locked, (VALUE)args, rb_str_unlocktmp, document));
 	}
+	sedna_instrument(conn);
 
-	// Signal that we're finished.
-	res = SEendLoadData(conn);
+	// If there is no data, raise an exception.
+	if(res == SEDNA_NO_DATA) rb_raise(cSednaException, "Document is empty.");
 	VERIFY_RES(SEDNA_BULK_LOAD_SUCCEEDED, res, conn);
+	sedna_cache_updated(self, conn);
 
 	// Always return nil if successful.
 	return Qnil;
@@ -777,10 +2376,127 @@ static VALUE cSedna_autocommit_get(VALUE self)
 	return rb_iv_get(self, IV_AUTOCOMMIT);
 }
 
+/* :nodoc:
+ *
+ * Turn typed results on or off.
+ */
+static VALUE cSedna_typed_results_set(VALUE self, VALUE typed)
+{
+	rb_iv_set(self, IV_TYPED, RTEST(typed) ? Qtrue : Qfalse);
+
+	// Always return nil if successful.
+	return Qnil;
+}
+
+/* :nodoc:
+ *
+ * Get the current typed results value.
+ */
+static VALUE cSedna_typed_results_get(VALUE self)
+{
+	return rb_iv_get(self, IV_TYPED);
+}
+
+/* :nodoc:
+ *
+ * Turn read-only transactions on or off.
+ */
+static VALUE cSedna_read_only_set(VALUE self, VALUE read_only)
+{
+	rb_iv_set(self, IV_READ_ONLY, RTEST(read_only) ? Qtrue : Qfalse);
+
+	// Always return nil if successful.
+	return Qnil;
+}
+
+/* :nodoc:
+ *
+ * Get the current read-only value.
+ */
+static VALUE cSedna_read_only_get(VALUE self)
+{
+	return rb_iv_get(self, IV_READ_ONLY);
+}
+
+/* :nodoc:
+ *
+ * Set the server-side query timeout.
+ */
+static VALUE cSedna_query_timeout_set(VALUE self, VALUE timeout)
+{
+	int seconds = sedna_timeout_seconds(timeout);
+	int res = sedna_timeout(sedna_struct(self), seconds);
+
+	VERIFY_RES(SEDNA_SET_ATTRIBUTE_SUCCEEDED, res, sedna_struct(self));
+	rb_iv_set(self, IV_QUERY_TIMEOUT, seconds > 0 ? INT2NUM(seconds) : Qnil);
+	return Qnil;
+}
+
+/* :nodoc:
+ *
+ * Get the server-side query timeout.
+ */
+static VALUE cSedna_query_timeout_get(VALUE self)
+{
+	return rb_iv_get(self, IV_QUERY_TIMEOUT);
+}
+
+/* :nodoc:
+ *
+ * Set the socket timeout.
+ */
+static VALUE cSedna_socket_timeout_set(VALUE self, VALUE timeout)
+{
+	SC *conn = sedna_struct(self);
+	double seconds = NIL_P(timeout) ? 0 : NUM2DBL(timeout);
+	int value, res;
+
+	if(seconds < 0) rb_raise(rb_eArgError, "Timeout must not be negative.");
+	if(seconds * 1000 > INT_MAX) rb_raise(rb_eArgError, "Timeout is too large.");
+	value = (int)ceil(seconds * 1000);
+	res = SEsetConnectionAttr(conn, SEDNA_ATTR_SOCKET_TIMEOUT, (void *)&value, sizeof(int));
+	VERIFY_RES(SEDNA_SET_ATTRIBUTE_SUCCEEDED, res, conn);
+	return Qnil;
+}
+
+/* :nodoc:
+ *
+ * Get the socket timeout.
+ */
+static VALUE cSedna_socket_timeout_get(VALUE self)
+{
+	int value = 0, length = 0;
+
+	SEgetConnectionAttr(sedna_struct(self), SEDNA_ATTR_SOCKET_TIMEOUT, (void *)&value, &length);
+	return value > 0 ? rb_float_new(value / 1000.0) : Qnil;
+}
+
+/* :nodoc:
+ *
+ * Set the result cache.
+ */
+static VALUE cSedna_cache_set(VALUE self, VALUE cache)
+{
+	if(!NIL_P(cache) && !rb_obj_is_kind_of(cache, cSednaCache)) rb_raise(rb_eTypeError, "Cache must be a Sedna::Cache or nil.");
+	rb_iv_set(self, IV_CACHE, cache);
+
+	// Always return nil if successful.
+	return Qnil;
+}
+
+/* :nodoc:
+ *
+ * Get the result cache.
+ */
+static VALUE cSedna_cache_get(VALUE self)
+{
+	return rb_iv_get(self, IV_CACHE);
+}
+
 /*
  * call-seq:
- *   sedna.transaction { ... } -> nil
- *   sedna.transaction -> nil
+ *   sedna.transaction(options = {}) { ... } -> nil
+ *   sedna.transaction(options = {}) -> nil
  *
  * Wraps the given block in a transaction. If the block runs completely, the
  * transaction is committed. If the stack is unwinded prematurely, the
@@ -806,6 +2522,12 @@ static VALUE cSedna_autocommit_get(VALUE self)
  * +commit+ and +rollback+ directly if you cannot use a block to wrap your
  * transaction in.
  *
+ * ==== Valid options
+ *
+ * * <tt>:read_only</tt> - Whether the transaction is read-only (defaults to
+ *   the value of Sedna#read_only). Read-only transactions take fewer locks on
+ *   the server and do not block each other, but any updates inside them fail.
+ *
  * ==== Examples
  *
  * Transactions are committed after the given block ends.
@@ -858,13 +2580,23 @@ static VALUE cSedna_autocommit_get(VALUE self)
  *     sedna.commit
  *   end
  */
-static VALUE cSedna_transaction(VALUE self)
+static VALUE cSedna_transaction(int argc, VALUE *argv, VALUE self)
 {
-	int status;
+	int status, read_only;
 	SC *conn = sedna_struct(self);
+	VALUE options, read_only_v;
+
+	// 1 optional argument.
+	rb_scan_args(argc, argv, "01", &options);
+	read_only = RTEST(rb_iv_get(self, IV_READ_ONLY));
+	if(!NIL_P(options)) {
+		Check_Type(options, T_HASH);
+		read_only_v = rb_hash_aref(options, ID2SYM(rb_intern("read_only")));
+		if(!NIL_P(read_only_v)) read_only = RTEST(read_only_v);
+	}
 
 	// Begin the transaction.
-	sedna_begin(conn);
+	sedna_begin(conn, read_only);
 
 	if(rb_block_given_p()) {
 		// Yield to the given block and protect it so we can always commit or rollback.
@@ -932,97 +2664,1245 @@ static VALUE cSedna_rollback(VALUE self)
 	return Qnil;
 }
 
-// Initialize the extension ==============================================
+// Connection pool functions ==============================================
 
-void Init_sedna()
+// Retrieve the SednaPool struct from the Ruby Sedna::Pool object obj.
+static SP* sedna_pool_struct(VALUE obj)
 {
-	/*
-	 * Objects of class Sedna represent a connection to a \Sedna XML
-	 * database. Establish a new connection by invoking the Sedna.connect
-	 * class method.
-	 *
-	 *   connection_details = {
-	 *     :database => "my_db",
-	 *     :host => "localhost",
-	 *     :username => "SYSTEM",
-	 *     :password => "MANAGER",
-	 *   }
-	 *
-	 *   Sedna.connect connection_details do |sedna|
-	 *     # Query the database.
-	 *     # The connection is closed automatically.
-	 *   end
-	 *
-	 * See the README for a high-level overview of how to use this library.
-	 */
-	cSedna = rb_define_class("Sedna", rb_cObject);
+	SP *pool;
+	Data_Get_Struct(obj, SP, pool);
+	return pool;
+}
 
-	rb_define_alloc_func(cSedna, cSedna_s_new);
-	rb_define_singleton_method(cSedna, "connect", cSedna_s_connect, 1);
-	rb_define_singleton_method(cSedna, "version", cSedna_s_version, 0);
-	rb_define_singleton_method(cSedna, "blocking?", cSedna_s_blocking, 0);
+static VALUE sedna_pool_unlock(VALUE mutex)
+{
+	return rb_funcall(mutex, rb_intern("unlock"), 0);
+}
 
-	rb_define_method(cSedna, "initialize", cSedna_initialize, 1);
-	rb_define_method(cSedna, "connected?", cSedna_connected, 0);
-	rb_define_method(cSedna, "close", cSedna_close, 0);
-	rb_define_method(cSedna, "reset", cSedna_reset, 0);
-	rb_define_method(cSedna, "transaction", cSedna_transaction, 0);
-	rb_define_method(cSedna, "commit", cSedna_commit, 0);
-	rb_define_method(cSedna, "rollback", cSedna_rollback, 0);
-	rb_define_method(cSedna, "execute", cSedna_execute, 1);
-	rb_define_undocumented_alias(cSedna, "query", "execute");
-	rb_define_method(cSedna, "load_document", cSedna_load_document, -1);
+// Call func while holding the mutex of the pool. The mutex is always released
+// again, even if func raises an exception.
+static VALUE sedna_pool_synchronize(VALUE self, VALUE (*func)(ANYARGS), SPA *a)
+{
+	VALUE mutex = rb_iv_get(self, IV_MUTEX);
+	rb_funcall(mutex, rb_intern("lock"), 0);
+	return rb_ensure(func, (VALUE)a, sedna_pool_unlock, mutex);
+}
 
-	/*
-	 * Document-attr: autocommit
-	 *
-	 * When autocommit is set to +true+ (default), database queries can be run
-	 * without explicitly wrapping them in a transaction. Each query that is not
-	 * part of a transaction is automatically committed to the database.
-	 * Explicit transactions in auto-commit mode will still be committed
-	 * atomically.
-	 * 
-	 * When autocommit is set to +false+, queries can only be run inside an
-	 * explicit transaction. Queries run outside transactions will fail with a
-	 * Sedna::Exception.
-	 */
-	/* Trick RDoc into thinking this is a regular attribute. We documented the
-	 * attribute above.
-	rb_define_attr(cSedna, "autocommit", 1, 1);
-	 */
-	rb_define_method(cSedna, "autocommit=", cSedna_autocommit_set, 1);
-	rb_define_method(cSedna, "autocommit", cSedna_autocommit_get, 0);
+// Wake up threads that are waiting for a connection.
+static void sedna_pool_signal(VALUE self)
+{
+	rb_funcall(rb_iv_get(self, IV_COND), rb_intern("broadcast"), 0);
+}
 
-	/*
-	 * The result of a database query is stored in a Sedna::Set object, which
-	 * is a subclass of Array. Additional details about the executed query, such
-	 * as timing and debug information, may be added to Sedna::Set objects in
-	 * future versions of this library.
-	 */
-	// Stick to Array for result sets.
-	//cSednaSet = rb_define_class_under(cSedna, "Set", rb_cArray);
+// Take a connection from the pool. Returns the most recently used idle
+// connection, or nil if a new connection may be opened. Waits until the
+// deadline has passed if all connections are in use.
+static VALUE sedna_pool_acquire(SPA *a)
+{
+	SP *pool = sedna_pool_struct(a->pool);
+	VALUE idle = rb_iv_get(a->pool, IV_IDLE);
+	double remaining;
 
-	/*
-	 * Generic exception class for errors. All errors raised by the \Sedna
-	 * client library are of type Sedna::Exception. The original error code
-	 * can be retrieved with the +code+ attribute. A list of all error codes
-	 * is defined in the \Sedna source:
-	 * http://modis.ispras.ru/src/sedna/kernel/common/errdbg/error.codes
-	 *
-	 * === Subclasses
-	 *
-	 * For some specific errors, an exception of a particular subtype is raised.
-	 *
-	 * [Sedna::AuthenticationError]
-	 *   Raised when a database connection was successfully established, but
-	 *   the supplied credentials were incorrect. Can only be raised when
-	 *   invoking Sedna.connect.
-	 * [Sedna::ConnectionError]
-	 *   Raised when a connection to a database could not be established or when
-	 *   a connection could not be closed. Can be raised when invoking Sedna.connect
-	 *   or Sedna#close.
+	while(1) {
+		if(pool->closed) rb_raise(cSednaConnError, "Connection pool is closed.");
+
+		if(RARRAY_LEN(idle) > 0) return rb_ary_entry(rb_ary_pop(idle), 0);
+
+		if(pool->created < pool->size) {
+			// Reserve room for a new connection.
+			pool->created++;
+			return Qnil;
+		}
+
+		remaining = a->deadline - sedna_now();
+		if(remaining <= 0) rb_raise(cSednaConnError, "Timed out waiting for a connection from the pool.");
+		rb_funcall(rb_iv_get(a->pool, IV_COND), rb_intern("wait"), 2, rb_iv_get(a->pool, IV_MUTEX), rb_float_new(remaining));
+	}
+}
+
+// Give up the room of a connection that was discarded.
+static VALUE sedna_pool_release(SPA *a)
+{
+	sedna_pool_struct(a->pool)->created--;
+	sedna_pool_signal(a->pool);
+	return Qnil;
+}
+
+// Put a connection back into the pool. Returns false if the pool has been
+// closed and the connection should be closed instead.
+static VALUE sedna_pool_return(SPA *a)
+{
+	SP *pool = sedna_pool_struct(a->pool);
+
+	if(pool->closed) {
+		pool->created--;
+		return Qfalse;
+	}
+	rb_ary_push(rb_iv_get(a->pool, IV_IDLE), rb_ary_new3(2, a->conn, rb_float_new(sedna_now())));
+	sedna_pool_signal(a->pool);
+	return Qtrue;
+}
+
+// Remove all connections from the pool that have been idle for too long, or
+// all idle connections if the pool is being closed. Returns the connections
+// that were removed.
+static VALUE sedna_pool_expire(SPA *a)
+{
+	SP *pool = sedna_pool_struct(a->pool);
+	VALUE idle = rb_iv_get(a->pool, IV_IDLE), expired = rb_ary_new();
+	double now = sedna_now();
+
+	// The least recently used connections are at the front.
+	while(RARRAY_LEN(idle) > 0 && (pool->closed || (pool->idle_timeout > 0 &&
+	      now - NUM2DBL(rb_ary_entry(rb_ary_entry(idle, 0), 1)) > pool->idle_timeout))) {
+		rb_ary_push(expired, rb_ary_entry(rb_ary_shift(idle), 0));
+		pool->created--;
+	}
+	if(RARRAY_LEN(expired) > 0) sedna_pool_signal(a->pool);
+	return expired;
+}
+
+// Mark the pool as closed and remove all idle connections from it.
+static VALUE sedna_pool_shutdown(SPA *a)
+{
+	sedna_pool_struct(a->pool)->closed = 1;
+	return sedna_pool_expire(a);
+}
+
+// Close all given connections, ignoring any errors.
+static void sedna_pool_close_all(VALUE conns)
+{
+	int i, status;
+	for(i = 0; i < RARRAY_LEN(conns); i++) {
+		rb_protect((void*)cSedna_close, rb_ary_entry(conns, i), &status);
+	}
+}
+
+// Open a new connection with the connection details of the pool.
+static VALUE sedna_pool_connect(VALUE self)
+{
+	return rb_funcall(cSedna, rb_intern("new"), 1, rb_iv_get(self, IV_DETAILS));
+}
+
+// Return a connection to the pool after the block given to Sedna::Pool#with.
+static VALUE sedna_pool_checkin(VALUE args)
+{
+	return rb_funcall(rb_ary_entry(args, 0), rb_intern("checkin"), 1, rb_ary_entry(args, 1));
+}
+
+// Functions of Sedna::Pool available from Ruby ===========================
+
+// Alocates memory for a SednaPool struct.
+static VALUE cSednaPool_s_new(VALUE klass)
+{
+	SP *pool = ALLOC(SP);
+	memset(pool, 0, sizeof(SP));
+	return Data_Wrap_Struct(klass, NULL, xfree, pool);
+}
+
+/*
+ * call-seq:
+ *   Sedna::Pool.new(details, options = {}) -> Sedna::Pool instance
+ *
+ * Creates a new pool of connections to a \Sedna XML database. The connection
+ * details are the same as those accepted by Sedna.connect. Connections are
+ * only opened when they are needed, so this method does not connect to the
+ * database.
+ *
+ * ==== Valid options
+ *
+ * * <tt>:size</tt> - The maximum number of connections in the pool (defaults to 5).
+ * * <tt>:timeout</tt> - The number of seconds to wait for a connection if all
+ *   connections are in use (defaults to 5).
+ * * <tt>:idle_timeout</tt> - The number of seconds after which unused connections
+ *   are closed (defaults to 300). Idle connections are never closed if set to +nil+.
+ *
+ * ==== Examples
+ *
+ * Create a pool that can be used by up to 16 threads at once.
+ *
+ *   pool = Sedna::Pool.new({:database => "my_db", :host => "my_host"}, :size => 16)
+ */
+static VALUE cSednaPool_initialize(int argc, VALUE *argv, VALUE self)
+{
+	VALUE details, options, size_v, timeout_v, idle_timeout_v;
+	SP *pool = sedna_pool_struct(self);
+
+	// 1 mandatory argument, 1 optional.
+	rb_scan_args(argc, argv, "11", &details, &options);
+	Check_Type(details, T_HASH);
+	if(NIL_P(options)) options = rb_hash_new();
+	Check_Type(options, T_HASH);
+
+	size_v = rb_hash_aref(options, ID2SYM(rb_intern("size")));
+	timeout_v = rb_hash_aref(options, ID2SYM(rb_intern("timeout")));
+	idle_timeout_v = rb_hash_aref(options, ID2SYM(rb_intern("idle_timeout")));
+
+	pool->size = NIL_P(size_v) ? DEFAULT_POOL_SIZE : NUM2INT(size_v);
+	pool->timeout = NIL_P(timeout_v) ? DEFAULT_POOL_TIMEOUT : NUM2DBL(timeout_v);
+	if(rb_funcall(options, rb_intern("has_key?"), 1, ID2SYM(rb_intern("idle_timeout"))) == Qfalse) {
+		pool->idle_timeout = DEFAULT_POOL_IDLE_TIMEOUT;
+	} else {
+		pool->idle_timeout = NIL_P(idle_timeout_v) ? 0 : NUM2DBL(idle_timeout_v);
+	}
+	if(pool->size < 1) rb_raise(rb_eArgError, "Pool size must be at least 1.");
+
+	rb_iv_set(self, IV_DETAILS, rb_obj_dup(details));
+	rb_iv_set(self, IV_IDLE, rb_ary_new());
+	rb_iv_set(self, IV_MUTEX, rb_funcall(rb_path2class("Mutex"), rb_intern("new"), 0));
+	rb_iv_set(self, IV_COND, rb_funcall(rb_path2class("ConditionVariable"), rb_intern("new"), 0));
+
+	return self;
+}
+
+/*
+ * call-seq:
+ *   pool.checkout -> Sedna instance
+ *
+ * Takes a connection from the pool. If no connection is available, a new one
+ * is opened, unless the pool is full. In that case this method waits until
+ * another thread returns a connection with Sedna::Pool#checkin. If no
+ * connection becomes available in time, a Sedna::ConnectionError is raised.
+ *
+ * Connections that have been closed by the server while they were in the pool
+ * are reconnected with Sedna#reset before they are returned. Connections that
+ * have been idle for too long are closed. The connection must be returned to
+ * the pool with Sedna::Pool#checkin. Using Sedna::Pool#with is preferred,
+ * because it will always return the connection.
+ */
+static VALUE cSednaPool_checkout(VALUE self)
+{
+	int status = 0;
+	SP *pool = sedna_pool_struct(self);
+	SPA a = { self, Qnil, sedna_now() + pool->timeout };
+
+	// Close connections that have not been used for a while.
+	sedna_pool_close_all(sedna_pool_synchronize(self, sedna_pool_expire, &a));
+
+	a.conn = sedna_pool_synchronize(self, sedna_pool_acquire, &a);
+
+	if(NIL_P(a.conn)) {
+		// Open a new connection.
+		a.conn = rb_protect(sedna_pool_connect, self, &status);
+	} else if(SEcheckConnection(sedna_struct(a.conn)) != SEDNA_CONNECTION_OK) {
+		// Reconnect if the server closed the connection in the mean time.
+		rb_protect(cSedna_reset, a.conn, &status);
+	}
+
+	if(status != 0) {
+		// Make room for another connection and re-raise the exception.
+		sedna_pool_synchronize(self, sedna_pool_release, &a);
+		rb_jump_tag(status);
+	}
+
+	return a.conn;
+}
+
+/*
+ * call-seq:
+ *   pool.checkin(sedna) -> nil
+ *
+ * Returns a connection that was taken from the pool with Sedna::Pool#checkout.
+ * Any transaction that is still in progress is rolled back. Connections that
+ * are no longer open, or that are returned after the pool was closed, are
+ * closed and discarded.
+ */
+static VALUE cSednaPool_checkin(VALUE self, VALUE conn)
+{
+	int status = 0;
+	SPA a = { self, conn, 0 };
+
+	if(!rb_obj_is_kind_of(conn, cSedna)) rb_raise(rb_eTypeError, "Expected a Sedna connection.");
+
+	// Roll back whatever was left unfinished.
+	if(SEtransactionStatus(sedna_struct(conn)) == SEDNA_TRANSACTION_ACTIVE) {
+		rb_protect((void*)cSedna_rollback, conn, &status);
+	}
+
+	if(status == 0 && SEconnectionStatus(sedna_struct(conn)) == SEDNA_CONNECTION_OK) {
+		if(RTEST(sedna_pool_synchronize(self, sedna_pool_return, &a))) return Qnil;
+	} else {
+		sedna_pool_synchronize(self, sedna_pool_release, &a);
+	}
+	sedna_pool_close_all(rb_ary_new3(1, conn));
+
+	// Always return nil if successful.
+	return Qnil;
+}
+
+/*
+ * call-seq:
+ *   pool.with {|sedna| ... } -> result of block
+ *
+ * Takes a connection from the pool, yields it to the given block and returns
+ * it to the pool afterwards, even if an exception is raised. Returns the
+ * result of the block. See Sedna::Pool#checkout.
+ *
+ * ==== Examples
+ *
+ * Query the database from one of many threads.
+ *
+ *   pool.with do |sedna|
+ *     sedna.execute "doc('mydoc')/message/text()"
+ *   end
+ *     #=> ["Hello world!"]
+ */
+static VALUE cSednaPool_with(VALUE self)
+{
+	VALUE conn = cSednaPool_checkout(self);
+	return rb_ensure(rb_yield, conn, sedna_pool_checkin, rb_ary_new3(2, self, conn));
+}
+
+/*
+ * call-seq:
+ *   pool.reap -> integer
+ *
+ * Closes all connections that have been idle for longer than the idle timeout
+ * of the pool. Returns the number of closed connections. This happens
+ * automatically when a connection is checked out, but may be called
+ * periodically to close idle connections of pools that are rarely used.
+ */
+static VALUE cSednaPool_reap(VALUE self)
+{
+	SPA a = { self, Qnil, 0 };
+	VALUE expired = sedna_pool_synchronize(self, sedna_pool_expire, &a);
+	sedna_pool_close_all(expired);
+	return INT2NUM(RARRAY_LEN(expired));
+}
+
+/*
+ * call-seq:
+ *   pool.close -> nil
+ *
+ * Closes all idle connections in the pool. Connections that are in use are
+ * closed when they are returned to the pool. Checking out connections from a
+ * closed pool raises a Sedna::ConnectionError.
+ */
+static VALUE cSednaPool_close(VALUE self)
+{
+	SPA a = { self, Qnil, 0 };
+	sedna_pool_close_all(sedna_pool_synchronize(self, sedna_pool_shutdown, &a));
+
+	// Always return nil if successful.
+	return Qnil;
+}
+
+/*
+ * call-seq:
+ *   pool.size -> integer
+ *
+ * Returns the maximum number of connections in the pool.
+ */
+static VALUE cSednaPool_size(VALUE self)
+{
+	return INT2NUM(sedna_pool_struct(self)->size);
+}
+
+// Prepared statement functions ==========================================
+
+// Get the SednaStatement struct from the Ruby object obj.
+static SS* sedna_statement_struct(VALUE obj)
+{
+	SS *stmt;
+	Data_Get_Struct(obj, SS, stmt);
+	return stmt;
+}
+
+// Free the memory of a SednaStatement struct. Called at GC.
+static void sedna_statement_free(SS *stmt)
+{
+	xfree(stmt->offsets);
+	xfree(stmt->sizes);
+	xfree(stmt->parts);
+	xfree(stmt->lengths);
+	xfree(stmt);
+}
+
+// Return the length of the placeholder %{name} at position i of str, or 0 if
+// there is no placeholder at that position.
+static long sedna_placeholder(const char *str, long len, long i)
+{
+	long j = i + 2;
+
+	if(j >= len || str[i] != '%' || str[i + 1] != '{') return 0;
+	if(!ISALPHA(str[j]) && str[j] != '_') return 0;
+	while(j < len && (ISALNUM(str[j]) || str[j] == '_')) j++;
+	return (j < len && str[j] == '}') ? j + 1 - i : 0;
+}
+
+// Split the query text into the static parts around its placeholders, which
+// are only located once. Returns the names of the placeholders in order.
+static VALUE sedna_statement_parse(SS *stmt, VALUE query)
+{
+	const char *str = RSTRING_PTR(query);
+	long len = RSTRING_LEN(query), i, n, start = 0;
+	int count = 0;
+	VALUE names = rb_ary_new();
+
+	if(len > INT_MAX) rb_raise(rb_eArgError, "Query is too long.");
+	for(i = 0; i < len; i += n ? n : 1) {
+		n = sedna_placeholder(str, len, i);
+		if(n) count++;
+	}
+
+	// Allocate the parts of all executions up front.
+	stmt->count = count;
+	stmt->offsets = ALLOC_N(long, count + 1);
+	stmt->sizes = ALLOC_N(long, count + 1);
+	stmt->parts = ALLOC_N(const char *, 2 * count + 1);
+	stmt->lengths = ALLOC_N(int, 2 * count + 1);
+
+	count = 0;
+	for(i = 0; i < len; i += n ? n : 1) {
+		n = sedna_placeholder(str, len, i);
+		if(n == 0) continue;
+		stmt->offsets[count] = start;
+		stmt->sizes[count++] = i - start;
+		rb_ary_push(names, ID2SYM(rb_intern2(str + i + 2, n - 3)));
+		start = i + n;
+	}
+	stmt->offsets[count] = start;
+	stmt->sizes[count] = len - start;
+
+	return names;
+}
+
+// Append the string str to buf as an XQuery string literal.
+static void sedna_string_literal(VALUE buf, VALUE str)
+{
+	const char *s = RSTRING_PTR(str), *end = s + RSTRING_LEN(str), *p;
+
+	rb_str_cat(buf, "\"", 1);
+	for(p = s; p < end; p++) {
+		if(*p != '"' && *p != '&') continue;
+		rb_str_cat(buf, s, p - s);
+		rb_str_cat2(buf, *p == '"' ? "\"\"" : "&amp;");
+		s = p + 1;
+	}
+	rb_str_cat(buf, s, end - s);
+	rb_str_cat(buf, "\"", 1);
+}
+
+// Append the XQuery literal that represents the Ruby object value to buf.
+// Arrays become sequences; strings and all other objects become strings.
+static void sedna_literal(VALUE buf, VALUE value)
+{
+	VALUE str;
+	long i;
+
+	if(NIL_P(value)) {
+		rb_str_cat2(buf, "()");
+	} else if(value == Qtrue || value == Qfalse) {
+		rb_str_cat2(buf, value == Qtrue ? "true()" : "false()");
+	} else if(FIXNUM_P(value) || TYPE(value) == T_BIGNUM) {
+		str = rb_obj_as_string(value);
+		rb_str_cat(buf, RSTRING_PTR(str), RSTRING_LEN(str));
+	} else if(TYPE(value) == T_FLOAT) {
+		if(isnan(RFLOAT_VALUE(value))) {
+			rb_str_cat2(buf, "xs:double('NaN')");
+		} else if(isinf(RFLOAT_VALUE(value))) {
+			rb_str_cat2(buf, RFLOAT_VALUE(value) > 0 ? "xs:double('INF')" : "xs:double('-INF')");
+		} else {
+			// Make sure the literal is an xs:double rather than an xs:decimal.
+			str = rb_obj_as_string(value);
+			rb_str_cat(buf, RSTRING_PTR(str), RSTRING_LEN(str));
+			if(memchr(RSTRING_PTR(str), 'e', RSTRING_LEN(str)) == NULL) rb_str_cat2(buf, "E0");
+		}
+	} else if(TYPE(value) == T_ARRAY) {
+		rb_str_cat2(buf, "(");
+		for(i = 0; i < RARRAY_LEN(value); i++) {
+			if(i > 0) rb_str_cat2(buf, ", ");
+			sedna_literal(buf, rb_ary_entry(value, i));
+		}
+		rb_str_cat2(buf, ")");
+	} else if(rb_obj_is_kind_of(value, rb_cTime)) {
+		rb_str_cat2(buf, "xs:dateTime(");
+		sedna_string_literal(buf, rb_funcall(value, rb_intern("strftime"), 1, rb_str_new2("%Y-%m-%dT%H:%M:%S.%6N%:z")));
+		rb_str_cat2(buf, ")");
+	} else {
+		sedna_string_literal(buf, rb_obj_as_string(value));
+	}
+}
+
+// Return the value of the parameter name from params, which may use either
+// symbols or strings as keys.
+static VALUE sedna_statement_param(VALUE params, VALUE name)
+{
+	VALUE key = rb_obj_as_string(name);
+
+	if(RTEST(rb_funcall(params, rb_intern("has_key?"), 1, name))) return rb_hash_aref(params, name);
+	if(RTEST(rb_funcall(params, rb_intern("has_key?"), 1, key))) return rb_hash_aref(params, key);
+	rb_raise(rb_eArgError, "No value given for parameter '%s'.", StringValueCStr(key));
+	return Qnil;
+}
+
+// Execute a prepared statement by sending its static parts interleaved with
+// the parameter literals, and record how long it took. This function is
+// called while holding the connection mutex, which also protects the parts
+// of the statement.
+static VALUE sedna_statement_run(SSA *a)
+{
+	SS *stmt = sedna_statement_struct(a->stmt);
+	VALUE query = rb_iv_get(a->stmt, IV_QUERY), joined = Qnil, result;
+	const char *str = RSTRING_PTR(query), *lit = RSTRING_PTR(a->literals);
+	long prev = 0;
+	double start, elapsed;
+	int i;
+
+	for(i = 0; i <= stmt->count; i++) {
+		stmt->parts[2 * i] = str + stmt->offsets[i];
+		stmt->lengths[2 * i] = (int)stmt->sizes[i];
+		if(i == stmt->count) break;
+		stmt->parts[2 * i + 1] = lit + prev;
+		stmt->lengths[2 * i + 1] = (int)(a->ends[i] - prev);
+		prev = a->ends[i];
+	}
+#ifdef HAVE_SEEXECUTEPARTS
+	a->q.parts = stmt->parts;
+	a->q.lengths = stmt->lengths;
+	a->q.count = 2 * stmt->count + 1;
+#else
+	// Older drivers only accept the complete query text.
+	joined = rb_str_buf_new(0);
+	for(i = 0; i < 2 * stmt->count + 1; i++) rb_str_cat(joined, stmt->parts[i], stmt->lengths[i]);
+	a->q.query = RSTRING_PTR(joined);
+#endif
+
+	start = sedna_now();
+	result = a->stream ? sedna_stream_results(&a->q) : sedna_execute_results(&a->q);
+	elapsed = sedna_now() - start;
+
+	if(stmt->executions == 0 || elapsed < stmt->min_time) stmt->min_time = elapsed;
+	if(elapsed > stmt->max_time) stmt->max_time = elapsed;
+	stmt->total_time += elapsed;
+	stmt->executions++;
+
+	RB_GC_GUARD(query);
+	RB_GC_GUARD(joined);
+	return result;
+}
+
+// Functions of Sedna::Statement available from Ruby ======================
+
+// Alocates memory for a SednaStatement struct.
+static VALUE cSednaStatement_s_new(VALUE klass)
+{
+	SS *stmt = ALLOC(SS);
+	memset(stmt, 0, sizeof(SS));
+	return Data_Wrap_Struct(klass, NULL, sedna_statement_free, stmt);
+}
+
+/*
+ * call-seq:
+ *   Sedna::Statement.new(sedna, query) -> Sedna::Statement instance
+ *
+ * Prepares the given +query+ for execution on the connection +sedna+. Use
+ * Sedna#prepare instead of calling this method directly.
+ */
+static VALUE cSednaStatement_initialize(VALUE self, VALUE sedna, VALUE query)
+{
+	SS *stmt = sedna_statement_struct(self);
+
+	if(!rb_obj_is_kind_of(sedna, cSedna)) rb_raise(rb_eTypeError, "Statements can only be prepared on a Sedna connection.");
+	if(stmt->offsets != NULL) rb_raise(rb_eRuntimeError, "Statement has been prepared already.");
+	StringValue(query);
+	query = rb_obj_freeze(rb_str_dup(query));
+
+	rb_iv_set(self, IV_SEDNA, sedna);
+	rb_iv_set(self, IV_QUERY, query);
+	rb_iv_set(self, IV_PARAMS, rb_obj_freeze(sedna_statement_parse(stmt, query)));
+
+	return self;
+}
+
+/*
+ * call-seq:
+ *   statement.execute(params = {}, options = {}) -> array or nil
+ *   statement.execute(params = {}, options = {}) {|result| ... } -> nil
+ *
+ * Executes the prepared statement with the values in the hash +params+ in
+ * place of its placeholders, and returns the results like Sedna#execute does.
+ * The hash must contain a value for every parameter, with either symbols or
+ * strings as keys. If a block is given, each result is yielded as soon as it
+ * has been received. The same options as for Sedna#execute are accepted.
+ *
+ * Parameter values are substituted as XQuery literals, so they cannot change
+ * the structure of the query:
+ *
+ * * +nil+ becomes the empty sequence.
+ * * +true+ and +false+ become boolean values.
+ * * Integers and floats become numeric values (floats as <tt>xs:double</tt>).
+ * * Time objects become <tt>xs:dateTime</tt> values.
+ * * Arrays become sequences of their elements.
+ * * Strings and all other objects become strings, with quotes and ampersands
+ *   escaped.
+ *
+ * The static parts of the statement are sent to the server as they are,
+ * together with the parameter literals, so that the query text does not have
+ * to be assembled for every execution.
+ *
+ * ==== Examples
+ *
+ *   stmt = sedna.prepare "doc('mydoc')/messages/message[@lang = %{lang}][position() <= %{limit}]"
+ *   stmt.execute :lang => "en", :limit => 10
+ *     #=> ["<message lang=\"en\">Hello world!</message>"]
+ */
+static VALUE cSednaStatement_execute(int argc, VALUE *argv, VALUE self)
+{
+	SS *stmt = sedna_statement_struct(self);
+	VALUE sedna = rb_iv_get(self, IV_SEDNA), names = rb_iv_get(self, IV_PARAMS);
+	VALUE params, options, literals = rb_str_buf_new(0), result;
+	SC *conn = sedna_struct(sedna);
+	long *ends = ALLOCA_N(long, stmt->count + 1);
+	int i;
+	SSA a;
+
+	// 2 optional arguments.
+	rb_scan_args(argc, argv, "02", &params, &options);
+	if(NIL_P(params)) params = rb_hash_new();
+	Check_Type(params, T_HASH);
+
+	// Collect the literals of all parameters in a single string, and record
+	// where each one ends.
+	for(i = 0; i < stmt->count; i++) {
+		sedna_literal(literals, sedna_statement_param(params, rb_ary_entry(names, i)));
+		ends[i] = RSTRING_LEN(literals);
+	}
+	if(RSTRING_LEN(literals) > INT_MAX) rb_raise(rb_eArgError, "Parameter values are too long.");
+
+	// Prepare statement arguments.
+	memset(&a, 0, sizeof(SSA));
+	a.stmt = self;
+	a.literals = literals;
+	a.ends = ends;
+	a.stream = rb_block_given_p();
+	a.q.conn = conn;
+	a.q.typed = RTEST(rb_iv_get(sedna, IV_TYPED));
+	a.q.sxml = sedna_query_sxml(options);
+	a.q.read_only = RTEST(rb_iv_get(sedna, IV_READ_ONLY));
+	a.q.timeout = sedna_query_timeout_option(sedna, options);
+
+	// Verify that the connection is OK.
+	if(SEconnectionStatus(conn) != SEDNA_CONNECTION_OK) rb_raise(cSednaConnError, "Connection is closed.");
+
+	// Execute the statement and read all results while holding the lock.
+	result = SEDNA_SYNCHRONIZE(sedna, sedna_statement_run, &a);
+	if(a.q.updated) sedna_cache_updated(sedna, conn);
+
+	RB_GC_GUARD(literals);
+	return result;
+}
+
+/*
+ * call-seq:
+ *   statement.stats -> hash
+ *
+ * Returns a hash with statistics of the executions of this statement:
+ * <tt>:executions</tt>, and the <tt>:total_time</tt>, <tt>:average_time</tt>,
+ * <tt>:min_time</tt> and <tt>:max_time</tt> in seconds. Executions that
+ * raised an exception are not counted.
+ */
+static VALUE cSednaStatement_stats(VALUE self)
+{
+	SS *stmt = sedna_statement_struct(self);
+	VALUE stats = rb_hash_new();
+
+	rb_hash_aset(stats, ID2SYM(rb_intern("executions")), LONG2NUM(stmt->executions));
+	rb_hash_aset(stats, ID2SYM(rb_intern("total_time")), rb_float_new(stmt->total_time));
+	rb_hash_aset(stats, ID2SYM(rb_intern("average_time")), rb_float_new(stmt->executions ? stmt->total_time / stmt->executions : 0.0));
+	rb_hash_aset(stats, ID2SYM(rb_intern("min_time")), rb_float_new(stmt->min_time));
+	rb_hash_aset(stats, ID2SYM(rb_intern("max_time")), rb_float_new(stmt->max_time));
+
+	return stats;
+}
+
+/*
+ * call-seq:
+ *   sedna.prepare(query) -> Sedna::Statement instance
+ *
+ * Prepares the given +query+ for repeated execution with different parameter
+ * values, and returns a Sedna::Statement. Placeholders in the query are
+ * written as <tt>%{name}</tt>, where the name consists of letters, digits
+ * and underscores. The query is parsed only once; each execution just sends
+ * the static parts of the query with the literals of the given values in
+ * between. See Sedna::Statement#execute.
+ *
+ * Placeholders are found by their text alone, so they are also substituted
+ * inside string literals and comments. A literal <tt>%{name}</tt> can be
+ * written as <tt>concat("%{", "name}")</tt> instead.
+ *
+ * ==== Examples
+ *
+ *   stmt = sedna.prepare "doc('mydoc')/messages/message[@id = %{id}]/text()"
+ *   stmt.execute :id => 1
+ *     #=> ["Hello world!"]
+ *   stmt.execute :id => 2
+ *     #=> ["Goodbye world!"]
+ */
+static VALUE cSedna_prepare(VALUE self, VALUE query)
+{
+	return rb_funcall(cSednaStatement, rb_intern("new"), 2, self, query);
+}
+
+// Functions of Sedna::Cache available from Ruby ==========================
+
+// Alocates memory for a SednaCache struct.
+static VALUE cSednaCache_s_new(VALUE klass)
+{
+	SRC *cache = ALLOC(SRC);
+	memset(cache, 0, sizeof(SRC));
+	return Data_Wrap_Struct(klass, NULL, xfree, cache);
+}
+
+/*
+ * call-seq:
+ *   Sedna::Cache.new(options = {}) -> Sedna::Cache instance
+ *
+ * Creates a new, empty result cache. Assign it to one or more connections
+ * with Sedna#cache= or the <tt>:cache</tt> connection detail.
+ *
+ * ==== Valid options
+ *
+ * * <tt>:size</tt> - The maximum number of bytes of results that are kept
+ *   (defaults to 8 megabytes). The least recently used results are evicted
+ *   first.
+ * * <tt>:ttl</tt> - The number of seconds after which cached results expire
+ *   (defaults to +nil+, which means that results only leave the cache when
+ *   they are evicted or when the cache is flushed).
+ *
+ * ==== Examples
+ *
+ * Cache up to 64 megabytes of results for at most 10 minutes.
+ *
+ *   cache = Sedna::Cache.new :size => 64 * 1024 * 1024, :ttl => 600
+ */
+static VALUE cSednaCache_initialize(int argc, VALUE *argv, VALUE self)
+{
+	VALUE options, size_v, ttl_v;
+	SRC *cache = sedna_cache_struct(self);
+
+	// 1 optional argument.
+	rb_scan_args(argc, argv, "01", &options);
+	if(NIL_P(options)) options = rb_hash_new();
+	Check_Type(options, T_HASH);
+
+	size_v = rb_hash_aref(options, ID2SYM(rb_intern("size")));
+	ttl_v = rb_hash_aref(options, ID2SYM(rb_intern("ttl")));
+
+	cache->max_bytes = NIL_P(size_v) ? DEFAULT_CACHE_SIZE : NUM2LONG(size_v);
+	cache->ttl = NIL_P(ttl_v) ? 0 : NUM2DBL(ttl_v);
+	if(cache->max_bytes < 0) rb_raise(rb_eArgError, "Cache size must not be negative.");
+	if(!NIL_P(ttl_v) && cache->ttl <= 0) rb_raise(rb_eArgError, "Cache TTL must be positive.");
+
+	rb_iv_set(self, IV_ENTRIES, rb_hash_new());
+
+	return self;
+}
+
+/*
+ * call-seq:
+ *   cache.clear -> nil
+ *
+ * Removes all results from the cache. The hit and miss counters are kept.
+ */
+static VALUE cSednaCache_clear(VALUE self)
+{
+	sedna_cache_flush(self);
+
+	// Always return nil if successful.
+	return Qnil;
+}
+
+/*
+ * call-seq:
+ *   cache.hits -> integer
+ *
+ * Returns the number of queries that were answered from the cache.
+ */
+static VALUE cSednaCache_hits(VALUE self)
+{
+	return LONG2NUM(sedna_cache_struct(self)->hits);
+}
+
+/*
+ * call-seq:
+ *   cache.misses -> integer
+ *
+ * Returns the number of cacheable queries that had to be sent to the
+ * database, because their results were not cached or had expired.
+ */
+static VALUE cSednaCache_misses(VALUE self)
+{
+	return LONG2NUM(sedna_cache_struct(self)->misses);
+}
+
+/*
+ * call-seq:
+ *   cache.bytes -> integer
+ *
+ * Returns the number of bytes of the results that are currently cached.
+ */
+static VALUE cSednaCache_bytes(VALUE self)
+{
+	return LONG2NUM(sedna_cache_struct(self)->bytes);
+}
+
+/*
+ * call-seq:
+ *   cache.length -> integer
+ *
+ * Returns the number of queries of which results are currently cached.
+ */
+static VALUE cSednaCache_length(VALUE self)
+{
+	return rb_funcall(rb_iv_get(self, IV_ENTRIES), rb_intern("length"), 0);
+}
+
+// Parallel bulk load functions ==========================================
+
+// Return the number of bytes of a document that will be loaded, or 0 if that
+// is not known in advance.
+static LONG_LONG sedna_bulk_load_size(VALUE document)
+{
+	VALUE stat;
+
+	if(TYPE(document) == T_STRING) return RSTRING_LEN(document);
+	if(TYPE(document) != T_FILE) return 0;
+
+	// Only the size of regular files is known.
+	stat = rb_funcall(document, rb_intern("stat"), 0);
+	if(!RTEST(rb_funcall(stat, rb_intern("file?"), 0))) return 0;
+	return NUM2LL(rb_funcall(stat, rb_intern("size"), 0)) - NUM2LL(rb_funcall(document, rb_intern("pos"), 0));
+}
+
+// Load the document described by args[1] with connection args[0]. Returns
+// the number of bytes that were loaded, if known.
+static VALUE sedna_bulk_load_document(VALUE args)
+{
+	VALUE sedna = ((VALUE*)args)[0], entry = rb_check_array_type(((VALUE*)args)[1]), document;
+	LONG_LONG size;
+
+	if(NIL_P(entry) || RARRAY_LEN(entry) < 2 || RARRAY_LEN(entry) > 3) {
+		rb_raise(rb_eArgError, "Documents must be given as [doc_name, document] or [doc_name, document, col_name].");
+	}
+	document = rb_ary_entry(entry, 1);
+	size = sedna_bulk_load_size(document);
+	rb_funcall(sedna, rb_intern("load_document"), 3, document, rb_ary_entry(entry, 0), rb_ary_entry(entry, 2));
+	return LL2NUM(size);
+}
+
+// Load documents with connection args[1] until there are none left. Every
+// worker takes the next document as soon as it has finished the previous one,
+// so that large documents do not hold up the other workers. The outcome of
+// each document is stored in b->results; the connection is reset if it was
+// lost while loading a document. If that fails, the worker stops and leaves
+// the remaining documents to the others. The last worker marks them as
+// failed with the exception of the reset instead.
+static VALUE sedna_bulk_load_documents(VALUE args)
+{
+	SBL *b = (SBL*)((VALUE*)args)[0];
+	VALUE sedna = ((VALUE*)args)[1], doc_args[2], res, exc;
+	long i;
+	int status;
+
+	doc_args[0] = sedna;
+	while((i = b->next++) < RARRAY_LEN(b->docs)) {
+		doc_args[1] = rb_ary_entry(b->docs, i);
+		res = rb_protect(sedna_bulk_load_document, (VALUE)doc_args, &status);
+		if(status == 0) {
+			b->loaded++;
+			b->bytes += NUM2LL(res);
+			continue;
+		}
+
+		// Anything other than an error, such as a thread being killed, ends the
+		// bulk load.
+		exc = rb_errinfo();
+		if(!rb_obj_is_kind_of(exc, rb_eStandardError)) rb_jump_tag(status);
+		rb_set_errinfo(Qnil);
+		rb_ary_store(b->results, i, exc);
+		b->failed++;
+
+		if(SEconnectionStatus(sedna_struct(sedna)) == SEDNA_CONNECTION_OK) continue;
+		rb_protect(cSedna_reset, sedna, &status);
+		if(status == 0) continue;
+
+		exc = rb_errinfo();
+		if(!rb_obj_is_kind_of(exc, rb_eStandardError)) rb_jump_tag(status);
+		rb_set_errinfo(Qnil);
+		if(--b->workers > 0) break;
+		while((i = b->next++) < RARRAY_LEN(b->docs)) {
+			rb_ary_store(b->results, i, exc);
+			b->failed++;
+		}
+	}
+	return Qnil;
+}
+
+// Run a worker of a bulk load with a connection of its own.
+static VALUE sedna_bulk_load_worker(void *b)
+{
+	VALUE args[2];
+
+	// Errors are raised by Sedna.bulk_load instead.
+	if(rb_respond_to(rb_thread_current(), rb_intern("report_on_exception="))) {
+		rb_funcall(rb_thread_current(), rb_intern("report_on_exception="), 1, Qfalse);
+	}
+
+	args[0] = (VALUE)b;
+	args[1] = rb_funcall(cSedna, rb_intern("new"), 1, ((SBL*)b)->details);
+	return rb_ensure(sedna_bulk_load_documents, (VALUE)args, cSedna_close, args[1]);
+}
+
+// Wait for all workers of a bulk load. Raises the exception of a worker that
+// did not finish.
+static VALUE sedna_bulk_load_join(VALUE threads)
+{
+	long i;
+	for(i = 0; i < RARRAY_LEN(threads); i++) {
+		rb_funcall(rb_ary_entry(threads, i), rb_intern("join"), 0);
+	}
+	return Qnil;
+}
+
+// Stop all workers of a bulk load that are still running, and wait until
+// they have closed their connections.
+static VALUE sedna_bulk_load_stop(VALUE threads)
+{
+	long i;
+	int status;
+	for(i = 0; i < RARRAY_LEN(threads); i++) {
+		rb_funcall(rb_ary_entry(threads, i), rb_intern("kill"), 0);
+	}
+	for(i = 0; i < RARRAY_LEN(threads); i++) {
+		rb_protect(sedna_bulk_load_join, rb_ary_new3(1, rb_ary_entry(threads, i)), &status);
+	}
+	return Qnil;
+}
+
+/*
+ * call-seq:
+ *   Sedna.bulk_load(details, documents, options = {}) -> Sedna::BulkLoadReport
+ *
+ * Loads many documents at once over several connections to a \Sedna XML
+ * database. The connection details are the same as those accepted by
+ * Sedna.connect. The argument +documents+ is an array of
+ * <tt>[doc_name, document]</tt> or <tt>[doc_name, document, col_name]</tt>
+ * arrays, or a hash of document names and documents. Each document can be
+ * a string or an IO object, like the arguments of Sedna#load_document.
+ *
+ * Every connection is used by a thread of its own, which loads the next
+ * document that has not been loaded yet as soon as it has finished the
+ * previous one. Documents are loaded without holding the global VM lock, so
+ * the threads run concurrently.
+ *
+ * A document that cannot be loaded does not stop the others from being
+ * loaded. Instead, the exception that was raised is stored in the results of
+ * the returned Sedna::BulkLoadReport. A connection that is lost is reset; if
+ * that fails, the other connections load the remaining documents. If there
+ * are none left, the remaining documents fail with the exception of the
+ * reset. A Sedna::ConnectionError is raised if a connection cannot be
+ * established at the start.
+ *
+ * ==== Valid options
+ *
+ * * <tt>:workers</tt> - The number of connections to load the documents with
+ *   (defaults to 4). No more connections are opened than there are documents.
+ *
+ * ==== Examples
+ *
+ * Load all XML files of a directory into a collection.
+ *
+ *   files = Dir.glob(File.join("feeds", "*.xml")).map { |path| File.open(path) }
+ *   docs = files.map { |file| [File.basename(file.path, ".xml"), file, "feeds"] }
+ *   report = Sedna.bulk_load({:database => "my_db"}, docs, :workers => 8)
+ *   files.each { |file| file.close }
+ *   report.failed             #=> 0
+ *   report.bytes_per_second   #=> 52428800.0
+ */
+static VALUE cSedna_s_bulk_load(int argc, VALUE *argv, VALUE klass)
+{
+	VALUE details, docs, options, workers_v, threads;
+	SBL b;
+	int workers, i;
+	double start, seconds;
+
+	// 2 mandatory arguments, 1 optional.
+	rb_scan_args(argc, argv, "21", &details, &docs, &options);
+	Check_Type(details, T_HASH);
+	if(NIL_P(options)) options = rb_hash_new();
+	Check_Type(options, T_HASH);
+
+	workers_v = rb_hash_aref(options, ID2SYM(rb_intern("workers")));
+	workers = NIL_P(workers_v) ? DEFAULT_BULK_LOAD_WORKERS : NUM2INT(workers_v);
+	if(workers < 1) rb_raise(rb_eArgError, "Number of workers must be at least 1.");
+
+	// Work on a copy of the documents, which cannot be changed meanwhile.
+	if(TYPE(docs) == T_HASH) docs = rb_funcall(docs, rb_intern("to_a"), 0);
+	Check_Type(docs, T_ARRAY);
+
+	b.details = details;
+	b.docs = rb_ary_dup(docs);
+	b.results = rb_ary_new2(RARRAY_LEN(b.docs));
+	b.next = 0;
+	b.bytes = 0;
+	b.loaded = 0;
+	b.failed = 0;
+	if(RARRAY_LEN(b.docs) > 0) rb_ary_store(b.results, RARRAY_LEN(b.docs) - 1, Qnil);
+	if(workers > RARRAY_LEN(b.docs)) workers = (int)RARRAY_LEN(b.docs);
+	b.workers = workers;
+
+	start = sedna_now();
+	threads = rb_ary_new2(workers);
+	for(i = 0; i < workers; i++) {
+		rb_ary_push(threads, rb_thread_create(sedna_bulk_load_worker, &b));
+	}
+
+	// The workers refer to b, so they must have stopped before returning.
+	rb_ensure(sedna_bulk_load_join, threads, sedna_bulk_load_stop, threads);
+	seconds = sedna_now() - start;
+
+	RB_GC_GUARD(details);
+	return rb_struct_new(cSednaBulkLoadReport, b.results, INT2NUM(b.loaded), INT2NUM(b.failed),
+		LL2NUM(b.bytes), rb_float_new(seconds),
+		rb_float_new(seconds > 0 ? b.loaded / seconds : 0.0), rb_float_new(seconds > 0 ? b.bytes / seconds : 0.0));
+}
+
+// Initialize the extension ==============================================
+
+void Init_sedna()
+{
+	/*
+	 * Objects of class Sedna represent a connection to a \Sedna XML
+	 * database. Establish a new connection by invoking the Sedna.connect
+	 * class method.
+	 *
+	 *   connection_details = {
+	 *     :database => "my_db",
+	 *     :host => "localhost",
+	 *     :username => "SYSTEM",
+	 *     :password => "MANAGER",
+	 *   }
+	 *
+	 *   Sedna.connect connection_details do |sedna|
+	 *     # Query the database.
+	 *     # The connection is closed automatically.
+	 *   end
+	 *
+	 * See the README for a high-level overview of how to use this library.
+	 */
+	cSedna = rb_define_class("Sedna", rb_cObject);
+
+	rb_define_alloc_func(cSedna, cSedna_s_new);
+	rb_define_singleton_method(cSedna, "connect", cSedna_s_connect, 1);
+	rb_define_singleton_method(cSedna, "version", cSedna_s_version, 0);
+	rb_define_singleton_method(cSedna, "blocking?", cSedna_s_blocking, 0);
+	rb_define_singleton_method(cSedna, "bulk_load", cSedna_s_bulk_load, -1);
+
+	rb_define_method(cSedna, "initialize", cSedna_initialize, 1);
+	rb_define_method(cSedna, "connected?", cSedna_connected, 0);
+	rb_define_method(cSedna, "protocol_version", cSedna_protocol_version, 0);
+	rb_define_method(cSedna, "close", cSedna_close, 0);
+	rb_define_method(cSedna, "reset", cSedna_reset, 0);
+	rb_define_method(cSedna, "reconnect_stats", cSedna_reconnect_stats, 0);
+	rb_define_method(cSedna, "reconnect_stats_clear", cSedna_reconnect_stats_clear, 0);
+	rb_define_method(cSedna, "stats", cSedna_stats, 0);
+	rb_define_method(cSedna, "stats_clear", cSedna_stats_clear, 0);
+	rb_define_method(cSedna, "instrument", cSedna_instrument, 0);
+	rb_define_method(cSedna, "transaction", cSedna_transaction, -1);
+	rb_define_method(cSedna, "commit", cSedna_commit, 0);
+	rb_define_method(cSedna, "rollback", cSedna_rollback, 0);
+	rb_define_method(cSedna, "execute", cSedna_execute, -1);
+	rb_define_undocumented_alias(cSedna, "query", "execute");
+	rb_define_method(cSedna, "each_result", cSedna_each_result, -1);
+	rb_define_method(cSedna, "execute_batch", cSedna_execute_batch, 1);
+	rb_define_method(cSedna, "prepare", cSedna_prepare, 1);
+	rb_define_method(cSedna, "load_document", cSedna_load_document, -1);
+
+	/*
+	 * Document-attr: autocommit
+	 *
+	 * When autocommit is set to +true+ (default), database queries can be run
+	 * without explicitly wrapping them in a transaction. Each query that is not
+	 * part of a transaction is automatically committed to the database.
+	 * Explicit transactions in auto-commit mode will still be committed
+	 * atomically.
+	 * 
+	 * When autocommit is set to +false+, queries can only be run inside an
+	 * explicit transaction. Queries run outside transactions will fail with a
+	 * Sedna::Exception.
+	 */
+	/* Trick RDoc into thinking this is a regular attribute. We documented the
+	 * attribute above.
+	rb_define_attr(cSedna, "autocommit", 1, 1);
+	 */
+	rb_define_method(cSedna, "autocommit=", cSedna_autocommit_set, 1);
+	rb_define_method(cSedna, "autocommit", cSedna_autocommit_get, 0);
+
+	/*
+	 * Document-attr: typed_results
+	 *
+	 * When typed_results is set to +false+ (default), every result of a query
+	 * is returned as a string.
+	 *
+	 * When typed_results is set to +true+, results that are atomic values of
+	 * the following types are returned as Ruby objects instead. They are
+	 * converted straight from the data that was received, without creating a
+	 * string first.
+	 *
+	 * * <tt>xs:integer</tt> and derived types - Integer
+	 * * <tt>xs:float</tt>, <tt>xs:double</tt> - Float
+	 * * <tt>xs:boolean</tt> - +true+ or +false+
+	 * * <tt>xs:dateTime</tt>, <tt>xs:date</tt> - Time, in the timezone of the
+	 *   value, or in UTC if it has none
+	 *
+	 * Nodes and atomic values of other types, such as <tt>xs:decimal</tt>, are
+	 * still returned as strings. The type of each result is only known if the
+	 * server reports it; all results are returned as strings otherwise.
+	 *
+	 *   sedna.typed_results = true
+	 *   sedna.execute "1 + 1, xs:double(0.5), 1 = 1, xs:date('2010-05-29')"
+	 *     #=> [2, 0.5, true, 2010-05-29 00:00:00 UTC]
+	 */
+	/* Trick RDoc into thinking this is a regular attribute. We documented the
+	 * attribute above.
+	rb_define_attr(cSedna, "typed_results", 1, 1);
+	 */
+	rb_define_method(cSedna, "typed_results=", cSedna_typed_results_set, 1);
+	rb_define_method(cSedna, "typed_results", cSedna_typed_results_get, 0);
+
+	/*
+	 * Document-attr: cache
+	 *
+	 * When cache is set to a Sedna::Cache, the results of Sedna#execute are
+	 * kept in it, and identical queries are answered from the cache without
+	 * contacting the database. The cache is bypassed inside transactions and
+	 * if autocommit is disabled. Any update or document load on a connection
+	 * that uses the cache flushes it. The same cache can be shared by several
+	 * connections, for example by all connections of a Sedna::Pool, so that
+	 * updates on any of them flush the cache for all of them.
+	 *
+	 * Only use a cache if the data that is queried is not changed by other
+	 * clients, or if slightly outdated results are acceptable (see the
+	 * <tt>:ttl</tt> option of Sedna::Cache.new).
+	 *
+	 *   sedna.cache = Sedna::Cache.new
+	 *   sedna.execute "doc('countries')//country/@code/string()"  # Queries the database.
+	 *   sedna.execute "doc('countries')//country/@code/string()"  # Returns cached results.
+	 */
+	/* Trick RDoc into thinking this is a regular attribute. We documented the
+	 * attribute above.
+	rb_define_attr(cSedna, "cache", 1, 1);
+	 */
+	rb_define_method(cSedna, "cache=", cSedna_cache_set, 1);
+	rb_define_method(cSedna, "cache", cSedna_cache_get, 0);
+
+	/*
+	 * Document-attr: read_only
+	 *
+	 * When read_only is set to +false+ (default), queries in autocommit mode and
+	 * transactions run as update transactions.
+	 *
+	 * When read_only is set to +true+, they run as read-only transactions
+	 * instead. Read-only transactions take fewer locks on the server and do not
+	 * have to wait for update transactions, but any updates inside them fail.
+	 * The setting can be overridden for a single transaction with the
+	 * <tt>:read_only</tt> option of Sedna#transaction. Sedna#execute_batch and
+	 * Sedna#load_document always run as update transactions.
+	 *
+	 * The concurrency type is only sent to the server when it changes, so this
+	 * setting does not cause any extra network round-trips for queries.
+	 *
+	 *   sedna.read_only = true
+	 *   sedna.execute "count(collection('articles'))"
+	 *     #=> ["12345"]
+	 */
+	/* Trick RDoc into thinking this is a regular attribute. We documented the
+	 * attribute above.
+	rb_define_attr(cSedna, "read_only", 1, 1);
+	 */
+	rb_define_method(cSedna, "read_only=", cSedna_read_only_set, 1);
+	rb_define_method(cSedna, "read_only", cSedna_read_only_get, 0);
+
+	/*
+	 * Document-attr: query_timeout
+	 *
+	 * The number of seconds after which the server aborts a query, which then
+	 * fails with a Sedna::Exception. The connection remains usable. When set to
+	 * +nil+ (default), queries run without a timeout. Fractions are rounded up
+	 * to whole seconds. The timeout of a single query can be changed with the
+	 * <tt>:timeout</tt> option of Sedna#execute.
+	 *
+	 * The timeout is only sent to the server together with the next query if it
+	 * changes, so this setting does not cause any extra network round-trips.
+	 *
+	 *   sedna.query_timeout = 10
+	 *   sedna.execute "count(collection('articles')//word)"
+	 */
+	/* Trick RDoc into thinking this is a regular attribute. We documented the
+	 * attribute above.
+	rb_define_attr(cSedna, "query_timeout", 1, 1);
+	 */
+	rb_define_method(cSedna, "query_timeout=", cSedna_query_timeout_set, 1);
+	rb_define_method(cSedna, "query_timeout", cSedna_query_timeout_get, 0);
+
+	/*
+	 * Document-attr: socket_timeout
+	 *
+	 * The number of seconds the client waits for the server to respond, at any
+	 * point during an operation, when the server does not respond. If it
+	 * expires, the operation fails with a Sedna::Exception with code +SE3082+,
+	 * and the connection is closed, which makes the server roll back the
+	 * current transaction. Use Sedna#reset to reconnect. When set to +nil+
+	 * (default), the client waits indefinitely.
+	 *
+	 * The socket timeout protects against a server that has stopped
+	 * responding. It should be longer than Sedna#query_timeout, so that slow
+	 * queries are aborted by the server first.
+	 *
+	 *   sedna.query_timeout = 10
+	 *   sedna.socket_timeout = 15
+	 */
+	/* Trick RDoc into thinking this is a regular attribute. We documented the
+	 * attribute above.
+	rb_define_attr(cSedna, "socket_timeout", 1, 1);
+	 */
+	rb_define_method(cSedna, "socket_timeout=", cSedna_socket_timeout_set, 1);
+	rb_define_method(cSedna, "socket_timeout", cSedna_socket_timeout_get, 0);
+
+	/*
+	 * The result of a database query is stored in a Sedna::Set object, which
+	 * is a subclass of Array. Additional details about the executed query, such
+	 * as timing and debug information, may be added to Sedna::Set objects in
+	 * future versions of this library.
+	 */
+	// Stick to Array for result sets.
+	//cSednaSet = rb_define_class_under(cSedna, "Set", rb_cArray);
+
+	/*
+	 * Generic exception class for errors. All errors raised by the \Sedna
+	 * client library are of type Sedna::Exception. The original error code
+	 * can be retrieved with the +code+ attribute. A list of all error codes
+	 * is defined in the \Sedna source:
+	 * http://modis.ispras.ru/src/sedna/kernel/common/errdbg/error.codes
+	 *
+	 * === Subclasses
+	 *
+	 * For some specific errors, an exception of a particular subtype is raised.
+	 *
+	 * [Sedna::AuthenticationError]
+	 *   Raised when a database connection was successfully established, but
+	 *   the supplied credentials were incorrect. Can only be raised when
+	 *   invoking Sedna.connect.
+	 * [Sedna::ConnectionError]
+	 *   Raised when a connection to a database could not be established or when
+	 *   a connection could not be closed. Can be raised when invoking Sedna.connect
+	 *   or Sedna#close.
 	 * [Sedna::TransactionError]
 	 *   Raised when a transaction could not be committed.
+	 * [Sedna::BatchError]
+	 *   Raised when a query in a batch fails. Can only be raised when invoking
+	 *   Sedna#execute_batch.
 	 */
 	cSednaException = rb_define_class_under(cSedna, "Exception", rb_eStandardError);
 
@@ -1055,4 +3935,108 @@ void Init_sedna()
 	 * raised when a transaction could not be committed.
 	 */
 	cSednaTrnError = rb_define_class_under(cSedna, "TransactionError", cSednaException);
+
+	/*
+	 * Sedna::BatchError is a subclass of Sedna::Exception, and is raised when
+	 * one of the queries passed to Sedna#execute_batch fails.
+	 */
+	cSednaBatchError = rb_define_class_under(cSedna, "BatchError", cSednaException);
+
+	/*
+	 * Returns the zero-based position of the query that failed in the array
+	 * that was passed to Sedna#execute_batch.
+	 */
+	rb_define_attr(cSednaBatchError, "index", 1, 0);
+
+	// Mutex and ConditionVariable are part of the thread library on Ruby 1.8.
+	rb_require("thread");
+
+	/*
+	 * Objects of class Sedna::Pool manage a number of connections to the same
+	 * \Sedna XML database that can be shared by multiple threads. Each thread
+	 * takes a connection from the pool when it needs one and returns it
+	 * afterwards, so that connections do not have to be established for every
+	 * unit of work and queries from different threads do not have to wait for
+	 * each other.
+	 *
+	 *   pool = Sedna::Pool.new({:database => "my_db"}, :size => 8)
+	 *
+	 *   pool.with do |sedna|
+	 *     # Query the database.
+	 *     # The connection is returned to the pool automatically.
+	 *   end
+	 */
+	cSednaPool = rb_define_class_under(cSedna, "Pool", rb_cObject);
+
+	rb_define_alloc_func(cSednaPool, cSednaPool_s_new);
+	rb_define_method(cSednaPool, "initialize", cSednaPool_initialize, -1);
+	rb_define_method(cSednaPool, "checkout", cSednaPool_checkout, 0);
+	rb_define_method(cSednaPool, "checkin", cSednaPool_checkin, 1);
+	rb_define_method(cSednaPool, "with", cSednaPool_with, 0);
+	rb_define_method(cSednaPool, "reap", cSednaPool_reap, 0);
+	rb_define_method(cSednaPool, "close", cSednaPool_close, 0);
+	rb_define_method(cSednaPool, "size", cSednaPool_size, 0);
+
+	/*
+	 * A Sedna::BulkLoadReport is returned by Sedna.bulk_load. Its +results+
+	 * hold +nil+ for every document that was loaded and the exception that was
+	 * raised for every document that failed, in the order of the documents.
+	 * The other members count the documents that were loaded or failed, the
+	 * bytes that were loaded (for strings and regular files), the elapsed time
+	 * in seconds, and the resulting throughput.
+	 */
+	cSednaBulkLoadReport = rb_struct_define(NULL, "results", "loaded", "failed", "bytes", "seconds",
+		"documents_per_second", "bytes_per_second", NULL);
+	rb_define_const(cSedna, "BulkLoadReport", cSednaBulkLoadReport);
+
+	/*
+	 * A Sedna::Statement is a query with named placeholders that has been
+	 * prepared for repeated execution with Sedna#prepare. Each execution
+	 * substitutes the given parameter values as XQuery literals.
+	 *
+	 *   stmt = sedna.prepare "doc('mydoc')/messages/message[@id = %{id}]/text()"
+	 *   stmt.parameters
+	 *     #=> [:id]
+	 *   stmt.execute :id => 1
+	 *     #=> ["Hello world!"]
+	 */
+	cSednaStatement = rb_define_class_under(cSedna, "Statement", rb_cObject);
+
+	rb_define_alloc_func(cSednaStatement, cSednaStatement_s_new);
+	rb_define_method(cSednaStatement, "initialize", cSednaStatement_initialize, 2);
+	rb_define_method(cSednaStatement, "execute", cSednaStatement_execute, -1);
+	rb_define_method(cSednaStatement, "stats", cSednaStatement_stats, 0);
+
+	/*
+	 * The query text of the statement, including its placeholders.
+	 */
+	rb_define_attr(cSednaStatement, "query", 1, 0);
+
+	/*
+	 * The names of the placeholders of the statement as symbols, in the order
+	 * in which they appear in the query.
+	 */
+	rb_define_attr(cSednaStatement, "parameters", 1, 0);
+
+	/*
+	 * A Sedna::Cache holds the results of queries, so that identical queries
+	 * can be answered without contacting the database. Caches can be assigned
+	 * to connections with Sedna#cache=. Each cache counts the queries that were
+	 * answered from it (hits) and the queries that were not (misses).
+	 *
+	 *   cache = Sedna::Cache.new :size => 16 * 1024 * 1024
+	 *   pool = Sedna::Pool.new :database => "my_db", :cache => cache
+	 *   pool.with { |sedna| sedna.execute "doc('countries')//country" }
+	 *   [cache.hits, cache.misses]
+	 *     #=> [0, 1]
+	 */
+	cSednaCache = rb_define_class_under(cSedna, "Cache", rb_cObject);
+
+	rb_define_alloc_func(cSednaCache, cSednaCache_s_new);
+	rb_define_method(cSednaCache, "initialize", cSednaCache_initialize, -1);
+	rb_define_method(cSednaCache, "clear", cSednaCache_clear, 0);
+	rb_define_method(cSednaCache, "hits", cSednaCache_hits, 0);
+	rb_define_method(cSednaCache, "misses", cSednaCache_misses, 0);
+	rb_define_method(cSednaCache, "bytes", cSednaCache_bytes, 0);
+	rb_define_method(cSednaCache, "length", cSednaCache_length, 0);
 }
\ No newline at end of file
@@ -0,0 +1,368 @@
+/*
+ * Copyright 2008-2010 Voormedia B.V.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Ruby extension library providing a client API to the Sedna native XML
+ * database management system, based on the official Sedna C driver.
+ *
+ * This file contains tests of the bundled C driver, which are run against
+ * the mock server of bench/mock_server.rb (see rake test_driver). Failed
+ * checks are printed, and the exit status is 1 if there were any.
+ *
+ * Usage: driver_test host:port
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "libsedna.h"
+
+#define ITEM_SIZE 30000
+#define FRAME_SIZE 262144
+
+static const char *host = "127.0.0.1:5050";
+static const struct SednaConnection initializer = SEDNA_CONNECTION_INITIALIZER;
+static int checks = 0, failures = 0;
+
+#define CHECK(condition) check((condition), #condition, __LINE__)
+
+static void check(int ok, const char *condition, int line)
+{
+    checks++;
+    if (!ok) {
+        failures++;
+        printf("driver_test.c:%d: check failed: %s\n", line, condition);
+    }
+}
+
+static char *resize(void *handle, char *buf, int used, int size)
+{
+    return realloc(buf, size);
+}
+
+/* opens a connection, in nonblocking mode if requested */
+static struct SednaConnection *open_connection(int nonblocking)
+{
+    struct SednaConnection *conn = malloc(sizeof(struct SednaConnection));
+    int mode = SEDNA_NONBLOCKING_ON;
+    *conn = initializer;
+    if (SEconnect(conn, host, "test", "SYSTEM", "MANAGER") != SEDNA_SESSION_OPEN) {
+        fprintf(stderr, "driver_test: SEconnect failed: %s\n", SEgetLastErrorMsg(conn));
+        exit(1);
+    }
+    if (nonblocking)
+        SEsetConnectionAttr(conn, SEDNA_ATTR_NONBLOCKING, &mode, sizeof(int));
+    return conn;
+}
+
+static void close_connection(struct SednaConnection *conn)
+{
+    SEclose(conn);
+    free(conn);
+}
+
+/* waits with select() until an asynchronous operation has finished, and
+   counts how often that was necessary */
+static int wait_for(struct SednaConnection *conn, int res, int *waits)
+{
+    while (res == SEDNA_POLL_READ || res == SEDNA_POLL_WRITE) {
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(SEgetSocket(conn), &fds);
+        select(SEgetSocket(conn) + 1, res == SEDNA_POLL_READ ? &fds : NULL,
+               res == SEDNA_POLL_WRITE ? &fds : NULL, NULL, NULL);
+        if (waits) (*waits)++;
+        res = SEpoll(conn);
+    }
+    return res;
+}
+
+/* returns whether an item consists of the given number of x's, preceded by
+   a newline if it is not the first item */
+static int is_item(const char *buf, int length, int size, int first)
+{
+    int i;
+    if (!first) {
+        if (length < 1 || buf[0] != '\n') return 0;
+        buf++;
+        length--;
+    }
+    if (length != size) return 0;
+    for (i = 0; i < length; i++)
+        if (buf[i] != 'x') return 0;
+    return 1;
+}
+
+/* executes a query and fetches its items, which are checked for size */
+static void fetch_items(struct SednaConnection *conn, const char *query, int count, int size, int *waits)
+{
+    int buf_size = 16, bytes_read, i;
+    char *buf = malloc(buf_size);
+    CHECK(wait_for(conn, SEexecuteAsync(conn, query), waits) == SEDNA_QUERY_SUCCEEDED);
+    for (i = 0; i < count; i++) {
+        CHECK(wait_for(conn, SEfetch(conn, &buf, &buf_size, &bytes_read, resize, NULL), waits) == SEDNA_NEXT_ITEM_SUCCEEDED);
+        CHECK(is_item(buf, bytes_read, size, i == 0));
+    }
+    CHECK(wait_for(conn, SEfetch(conn, &buf, &buf_size, &bytes_read, resize, NULL), waits) == SEDNA_RESULT_END);
+    free(buf);
+}
+
+/* Test connections that are allocated by the driver. */
+static void test_create_and_destroy_connection()
+{
+    struct SednaConnection *conn = SEcreateConnection();
+    CHECK(conn != NULL);
+    CHECK(SEconnectionStatus(conn) == SEDNA_CONNECTION_CLOSED);
+    CHECK(SEconnect(conn, host, "test", "SYSTEM", "MANAGER") == SEDNA_SESSION_OPEN);
+    CHECK(SEexecute(conn, "items(2, 30000)") == SEDNA_QUERY_SUCCEEDED);
+    CHECK(SEnext(conn) == SEDNA_NEXT_ITEM_SUCCEEDED);
+    /* the session is closed, although a result is still being read */
+    SEdestroyConnection(conn);
+}
+
+static void test_destroy_connection_that_failed()
+{
+    struct SednaConnection *conn = SEcreateConnection();
+    CHECK(SEconnect(conn, "127.0.0.1:1", "test", "SYSTEM", "MANAGER") == SEDNA_OPEN_SESSION_FAILED);
+    CHECK(strlen(SEgetLastErrorMsg(conn)) > 0);
+    SEdestroyConnection(conn);
+    SEdestroyConnection(NULL);
+}
+
+/* Test the fallback to the previous protocol version. */
+static void test_no_protocol_fallback_after_timeout()
+{
+    struct SednaConnection *conn = SEcreateConnection();
+    int timeout = 300;
+    struct timeval start, end;
+    SEsetConnectionAttr(conn, SEDNA_ATTR_SOCKET_TIMEOUT, &timeout, sizeof(int));
+    gettimeofday(&start, NULL);
+    CHECK(SEconnect(conn, host, "silent", "SYSTEM", "MANAGER") == SEDNA_OPEN_SESSION_FAILED);
+    gettimeofday(&end, NULL);
+    /* the session is not opened again with protocol 3.0 after the timeout */
+    CHECK((end.tv_sec - start.tv_sec) * 1000 + (end.tv_usec - start.tv_usec) / 1000 < 2 * timeout);
+    CHECK(strstr(SEgetLastErrorMsg(conn), "SE3082") != NULL);
+    SEdestroyConnection(conn);
+}
+
+/* Test items that are sent in messages larger than SE_SOCKET_MSG_BUF_SIZE. */
+static void test_items_of_large_messages(int nonblocking)
+{
+    struct SednaConnection *conn = open_connection(nonblocking);
+    int size = 2 * FRAME_SIZE;
+    SEsetConnectionAttr(conn, SEDNA_ATTR_MAX_MESSAGE_SIZE, &size, sizeof(int));
+    fetch_items(conn, "items(3, 600000, 262144)", 3, 600000, NULL);
+    /* the receive buffer shrinks again at the end of the result */
+    CHECK(conn->recv_buf.size <= SE_SOCKET_RECV_BUF_SIZE);
+    fetch_items(conn, "items(2, 100)", 2, 100, NULL);
+    close_connection(conn);
+}
+
+static void test_get_data_of_large_messages()
+{
+    struct SednaConnection *conn = open_connection(0);
+    int size = 2 * FRAME_SIZE, bytes_read, i;
+    char *buf = malloc(600001);
+    SEsetConnectionAttr(conn, SEDNA_ATTR_MAX_MESSAGE_SIZE, &size, sizeof(int));
+    CHECK(SEexecute(conn, "items(2, 600000, 262144)") == SEDNA_QUERY_SUCCEEDED);
+    for (i = 0; i < 2; i++) {
+        CHECK(SEnext(conn) == SEDNA_NEXT_ITEM_SUCCEEDED);
+        bytes_read = SEgetData(conn, buf, 600001);
+        CHECK(is_item(buf, bytes_read, 600000, i == 0));
+        CHECK(SEgetData(conn, buf, 600001) == 0);
+    }
+    CHECK(SEnext(conn) == SEDNA_RESULT_END);
+    CHECK(conn->recv_buf.size <= SE_SOCKET_RECV_BUF_SIZE);
+    free(buf);
+    close_connection(conn);
+}
+
+/* Test statements with invalid arguments after a session option has changed. */
+static void test_invalid_length_after_option_change()
+{
+    struct SednaConnection *conn = open_connection(0);
+    const char *parts[] = {"items(2, ", "100)"};
+    int lengths[] = {9, -1}, timeout = 5;
+    SEsetConnectionAttr(conn, SEDNA_ATTR_QUERY_EXEC_TIMEOUT, &timeout, sizeof(int));
+    CHECK(SEexecuteParts(conn, parts, lengths, 2) == SEDNA_ERROR);
+    CHECK(SEconnectionStatus(conn) == SEDNA_CONNECTION_OK);
+    /* the option is sent with the next statement, which gets its own reply */
+    fetch_items(conn, "items(2, 100)", 2, 100, NULL);
+    close_connection(conn);
+}
+
+static void test_missing_query_file_after_option_change()
+{
+    struct SednaConnection *conn = open_connection(0);
+    int mode = SEDNA_AUTOCOMMIT_OFF, timeout = 5;
+    SEsetConnectionAttr(conn, SEDNA_ATTR_AUTOCOMMIT, &mode, sizeof(int));
+    CHECK(SEbegin(conn) == SEDNA_BEGIN_TRANSACTION_SUCCEEDED);
+    SEsetConnectionAttr(conn, SEDNA_ATTR_QUERY_EXEC_TIMEOUT, &timeout, sizeof(int));
+    CHECK(SEexecuteLong(conn, "test/no_such_query_file") == SEDNA_ERROR);
+    CHECK(SEconnectionStatus(conn) == SEDNA_CONNECTION_OK);
+    fetch_items(conn, "items(2, 100)", 2, 100, NULL);
+    close_connection(conn);
+}
+
+/* Test transactions. */
+static void test_autocommit_on_while_reading_result()
+{
+    struct SednaConnection *conn = open_connection(0);
+    int mode = SEDNA_AUTOCOMMIT_OFF;
+    char buf[100];
+    SEsetConnectionAttr(conn, SEDNA_ATTR_AUTOCOMMIT, &mode, sizeof(int));
+    CHECK(SEbegin(conn) == SEDNA_BEGIN_TRANSACTION_SUCCEEDED);
+    CHECK(SEexecute(conn, "items(2, 30000)") == SEDNA_QUERY_SUCCEEDED);
+    CHECK(SEnext(conn) == SEDNA_NEXT_ITEM_SUCCEEDED);
+    CHECK(SEgetData(conn, buf, sizeof(buf)) == sizeof(buf));
+    /* the rest of the result must be skipped before committing */
+    mode = SEDNA_AUTOCOMMIT_ON;
+    CHECK(SEsetConnectionAttr(conn, SEDNA_ATTR_AUTOCOMMIT, &mode, sizeof(int)) == SEDNA_SET_ATTRIBUTE_SUCCEEDED);
+    CHECK(SEtransactionStatus(conn) == SEDNA_NO_TRANSACTION);
+    fetch_items(conn, "items(2, 100)", 2, 100, NULL);
+    close_connection(conn);
+}
+
+/* Test sockets with descriptors that do not fit in an fd_set. */
+static void test_socket_above_fd_setsize()
+{
+    struct rlimit limit;
+    struct SednaConnection *conn;
+    int fds[FD_SETSIZE], count = 0, timeout = 5000;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    if (limit.rlim_cur <= FD_SETSIZE + 10) {
+        limit.rlim_cur = FD_SETSIZE + 10;
+        if (limit.rlim_max < limit.rlim_cur || setrlimit(RLIMIT_NOFILE, &limit) != 0) {
+            printf("driver_test: skipped test_socket_above_fd_setsize\n");
+            return;
+        }
+    }
+    /* take all lower descriptors, so that the socket gets a higher one */
+    while (count < FD_SETSIZE && (fds[count] = open("/dev/null", O_RDONLY)) >= 0)
+        if (fds[count++] == FD_SETSIZE - 1) break;
+    conn = open_connection(0);
+    CHECK(SEgetSocket(conn) >= FD_SETSIZE);
+    SEsetConnectionAttr(conn, SEDNA_ATTR_SOCKET_TIMEOUT, &timeout, sizeof(int));
+    fetch_items(conn, "slow items(3, 30000)", 3, ITEM_SIZE, NULL);
+    CHECK(SEcheckConnection(conn) == SEDNA_CONNECTION_OK);
+    close_connection(conn);
+    while (count > 0)
+        close(fds[--count]);
+}
+
+/* Test interrupts of blocking operations from another thread. */
+static void *interrupt_later(void *conn)
+{
+    usleep(100000);
+    SEinterrupt(conn);
+    return NULL;
+}
+
+static int interrupt_handler(void *result)
+{
+    return (*(int *)result)++;
+}
+
+static void test_interrupt_handler(int result)
+{
+    struct SednaConnection *conn = open_connection(0);
+    pthread_t thread;
+    int calls = result;
+    char buf[100];
+    SEsetInterruptHandler(conn, interrupt_handler, &calls);
+    pthread_create(&thread, NULL, interrupt_later, conn);
+    if (result == 0) {
+        /* the handler lets the query go on */
+        CHECK(SEexecute(conn, "sleep(0.3)") == SEDNA_QUERY_SUCCEEDED);
+        CHECK(SEnext(conn) == SEDNA_NEXT_ITEM_SUCCEEDED);
+        CHECK(SEgetData(conn, buf, sizeof(buf)) == 10 && memcmp(buf, "sleep(0.3)", 10) == 0);
+        CHECK(SEnext(conn) == SEDNA_RESULT_END);
+        CHECK(calls == 1);
+    } else {
+        CHECK(SEexecute(conn, "sleep(0.3)") == SEDNA_ERROR);
+        CHECK(SEconnectionStatus(conn) == SEDNA_CONNECTION_FAILED);
+        CHECK(calls == 2);
+    }
+    pthread_join(thread, NULL);
+    close_connection(conn);
+}
+
+/* Test the asynchronous query API. */
+static void test_async_items_of_several_messages(int nonblocking)
+{
+    struct SednaConnection *conn = open_connection(nonblocking);
+    fetch_items(conn, "items(3, 30000)", 3, ITEM_SIZE, NULL);
+    fetch_items(conn, "items(2, 100)", 2, 100, NULL);
+    close_connection(conn);
+}
+
+static void test_async_resume_after_partial_messages()
+{
+    struct SednaConnection *conn = open_connection(1);
+    int waits = 0;
+    fetch_items(conn, "slow items(3, 30000)", 3, ITEM_SIZE, &waits);
+    /* every message arrives in two halves */
+    CHECK(waits > 3);
+    close_connection(conn);
+}
+
+static void test_async_error_in_the_middle_of_a_result(int nonblocking)
+{
+    struct SednaConnection *conn = open_connection(nonblocking);
+    int buf_size = 16, bytes_read;
+    char *buf = malloc(buf_size);
+    CHECK(wait_for(conn, SEexecuteAsync(conn, "fail_after(2, 30000)"), NULL) == SEDNA_QUERY_SUCCEEDED);
+    CHECK(wait_for(conn, SEfetch(conn, &buf, &buf_size, &bytes_read, resize, NULL), NULL) == SEDNA_NEXT_ITEM_SUCCEEDED);
+    CHECK(is_item(buf, bytes_read, ITEM_SIZE, 1));
+    CHECK(wait_for(conn, SEfetch(conn, &buf, &buf_size, &bytes_read, resize, NULL), NULL) == SEDNA_NEXT_ITEM_SUCCEEDED);
+    CHECK(is_item(buf, bytes_read, ITEM_SIZE, 0));
+    CHECK(wait_for(conn, SEfetch(conn, &buf, &buf_size, &bytes_read, resize, NULL), NULL) == SEDNA_ERROR);
+    CHECK(strstr(SEgetLastErrorMsg(conn), "Mock failure.") != NULL);
+    /* the connection can be used for the next query */
+    fetch_items(conn, "items(2, 100)", 2, 100, NULL);
+    free(buf);
+    close_connection(conn);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1) host = argv[1];
+
+    test_create_and_destroy_connection();
+    test_destroy_connection_that_failed();
+    test_no_protocol_fallback_after_timeout();
+    test_items_of_large_messages(0);
+    test_items_of_large_messages(1);
+    test_get_data_of_large_messages();
+    test_invalid_length_after_option_change();
+    test_missing_query_file_after_option_change();
+    test_autocommit_on_while_reading_result();
+    test_socket_above_fd_setsize();
+    test_interrupt_handler(0);
+    test_interrupt_handler(1);
+    test_async_items_of_several_messages(0);
+    test_async_items_of_several_messages(1);
+    test_async_resume_after_partial_messages();
+    test_async_error_in_the_middle_of_a_result(0);
+    test_async_error_in_the_middle_of_a_result(1);
+
+    printf("%d checks, %d failures\n", checks, failures);
+    return failures ? 1 : 0;
+}
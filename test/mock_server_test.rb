@@ -0,0 +1,208 @@
+#!/usr/bin/env ruby
+# encoding: utf-8
+
+# Copyright 2008-2010 Voormedia B.V.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# Ruby extension library providing a client API to the Sedna native XML
+# database management system, based on the official Sedna C driver.
+
+# This file contains tests that run against the mock server of
+# bench/mock_server.rb instead of a Sedna database, so that replies can be
+# tested that a real server does not send.
+
+$:.unshift(File.dirname(__FILE__) + '/../ext/sedna')
+
+require 'test/unit'
+require 'sedna'
+require File.expand_path(File.dirname(__FILE__) + '/../bench/mock_server')
+
+class MockServerTest < Test::Unit::TestCase
+  # Support declarative specification of test methods.
+  def self.test name, &block
+    define_method "test_#{name.gsub(/\s+/,'_')}".to_sym, &block
+  end
+
+  # Start a mock server for every test.
+  def setup
+    @server = MockSedna.new.start
+    @spec = {
+      :database => "test",
+      :host => "127.0.0.1:#{@server.port}",
+      :username => "SYSTEM",
+      :password => "MANAGER",
+    }
+  end
+
+  def teardown
+    @server.stop
+  end
+
+  # Test messages with invalid lengths.
+  test "execute should fail and break connection if message length is negative" do
+    Sedna.connect @spec do |sedna|
+      assert_raises Sedna::Exception do
+        sedna.execute "bad_length(-1)"
+      end
+      assert_equal false, sedna.connected?
+      assert_raises Sedna::ConnectionError do
+        sedna.execute "<test/>"
+      end
+    end
+  end
+
+  test "execute should fail and break connection if message is too long" do
+    Sedna.connect @spec do |sedna|
+      assert_raises Sedna::Exception do
+        sedna.execute "bad_length(20000)"
+      end
+      assert_equal false, sedna.connected?
+      sedna.reset
+      assert_equal ["<test/>"], sedna.execute("<test/>")
+    end
+  end
+
+  # Test the fallback to the previous protocol version.
+  test "connect should fall back to protocol 3.0 if server closes connection" do
+    Sedna.connect @spec.merge(:database => "protocol3") do |sedna|
+      assert_equal "3.0", sedna.protocol_version
+      assert_equal ["<test/>"], sedna.execute("<test/>")
+    end
+  end
+
+  # Test items that are sent in several messages.
+  test "execute should return items that are larger than a message intact" do
+    Sedna.connect @spec do |sedna|
+      assert_equal ["x" * 30000] * 3, sedna.execute("items(3, 30000)")
+      assert_equal ["<test/>"], sedna.execute("<test/>")
+    end
+  end
+
+  test "each_result should return items that are larger than a message intact" do
+    Sedna.connect @spec do |sedna|
+      results = []
+      sedna.each_result("items(3, 30000)") { |item| results << item }
+      assert_equal ["x" * 30000] * 3, results
+    end
+  end
+
+  # Test the query timeout.
+  test "execute should only send timeout if it differs from that of previous statement" do
+    Sedna.connect @spec do |sedna|
+      sedna.stats_clear
+      sedna.execute "<test/>", :timeout => 5
+      sedna.execute "<test/>", :timeout => 5
+      assert_equal 1, sedna.stats[:round_trips][:options][:count]
+      sedna.execute "<test/>"
+      sedna.execute "<test/>"
+      assert_equal 2, sedna.stats[:round_trips][:options][:count]
+    end
+  end
+
+  test "execute_batch and load_document should use timeout of connection after query with timeout" do
+    Sedna.connect @spec.merge(:query_timeout => 10) do |sedna|
+      sedna.execute "<test/>", :timeout => 5
+      sedna.stats_clear
+      sedna.execute_batch ["update insert <test/> into doc('test')"]
+      sedna.load_document "<test/>", "test"
+      assert_equal 1, sedna.stats[:round_trips][:options][:count]
+      assert_equal 10, sedna.query_timeout
+    end
+  end
+
+  # Test interrupts of threads that wait for the server.
+  test "execute should not fail if a trapped signal interrupts it" do
+    Sedna.connect @spec do |sedna|
+      trapped_at = nil
+      previous = trap("USR2") { trapped_at = Time.now }
+      begin
+        Thread.new { sleep 0.1; Process.kill "USR2", Process.pid }
+        assert_equal ["sleep(0.5)"], sedna.execute("sleep(0.5)")
+        assert_operator trapped_at, :<, Time.now - 0.2
+      ensure
+        trap "USR2", previous
+      end
+    end
+  end
+
+  test "execute should not fail if its thread is woken up" do
+    Sedna.connect @spec do |sedna|
+      thread = Thread.new { sedna.execute "sleep(0.5)" }
+      sleep 0.1
+      thread.wakeup
+      assert_equal ["sleep(0.5)"], thread.value
+    end
+  end
+
+  test "execute should fail and break connection if exception is raised in its thread" do
+    Sedna.connect @spec do |sedna|
+      thread = Thread.new do
+        begin
+          sedna.execute "sleep(5)"
+        rescue RuntimeError => e
+          e
+        end
+      end
+      sleep 0.1
+      started = Time.now
+      thread.raise RuntimeError, "stop"
+      assert_equal "stop", thread.value.message
+      assert_operator Time.now - started, :<, 1
+      assert_equal false, sedna.connected?
+    end
+  end
+
+  test "execute should fail and break connection if its thread is killed" do
+    Sedna.connect @spec do |sedna|
+      thread = Thread.new { sedna.execute "sleep(5)" }
+      sleep 0.1
+      started = Time.now
+      thread.kill.join
+      assert_operator Time.now - started, :<, 1
+      assert_equal false, sedna.connected?
+    end
+  end
+
+  test "load_document should fail and break connection if its thread is killed while reading a pipe" do
+    Sedna.connect @spec do |sedna|
+      reader, writer = IO.pipe
+      thread = Thread.new { sedna.load_document reader, "test" }
+      sleep 0.1
+      started = Time.now
+      thread.kill.join
+      assert_operator Time.now - started, :<, 1
+      assert_equal false, sedna.connected?
+      writer.close
+      reader.close
+    end
+  end
+
+  # Test Sedna.bulk_load with connections that cannot be reset.
+  test "bulk_load should leave documents to other workers if connection cannot be reset" do
+    docs = [["disconnect", "<doc/>"]] + (1..20).map { |i| ["doc#{i}", "<doc/>"] }
+    report = Sedna.bulk_load @spec, docs, :workers => 2
+    assert_kind_of Sedna::Exception, report.results[0]
+    assert_equal [nil] * 20, report.results[1..-1]
+    assert_equal [20, 1], [report.loaded, report.failed]
+  end
+
+  test "bulk_load should fail remaining documents if last connection cannot be reset" do
+    docs = [["disconnect", "<doc/>"], ["doc1", "<doc/>"], ["doc2", "<doc/>"]]
+    report = Sedna.bulk_load @spec, docs, :workers => 1
+    assert_equal 3, report.results.length
+    report.results.each { |result| assert_kind_of Sedna::Exception, result }
+    assert_kind_of Sedna::ConnectionError, report.results[1]
+    assert_equal [0, 3], [report.loaded, report.failed]
+  end
+end
@@ -26,6 +26,7 @@ $:.unshift(File.dirname(__FILE__) + '/../ext/sedna')
 require 'test/unit'
 require 'sedna'
 require 'socket'
+require 'tempfile'
 
 class SednaTest < Test::Unit::TestCase
   # Support declarative specification of test methods.
@@ -59,8 +60,8 @@ class SednaTest < Test::Unit::TestCase
   @@sedna = Sedna.connect @@spec
 
   # Test Sedna.version.
-  test "version should return 3.0" do
-    assert_equal "3.0", Sedna.version
+  test "version should return 4.0" do
+    assert_equal "4.0", Sedna.version
   end
   
   # Test Sedna.blocking?
@@ -96,6 +97,18 @@ class SednaTest < Test::Unit::TestCase
       Sedna.connect @@spec.merge(:username => "non-existent-user")
     end
   end
+
+  test "connect should raise ArgumentError if reconnect attempts is less than 1" do
+    assert_raises ArgumentError do
+      Sedna.connect @@spec.merge(:reconnect_attempts => 0)
+    end
+  end
+
+  test "connect should succeed with connect timeout" do
+    Sedna.connect @@spec.merge(:connect_timeout => 5) do |sedna|
+      assert_equal ["<test/>"], sedna.execute("<test/>")
+    end
+  end
   
   test "connect should return nil on error" do
     begin
@@ -192,6 +205,17 @@ class SednaTest < Test::Unit::TestCase
     assert_equal false, sedna.connected?
   end
   
+  # Test sedna.protocol_version.
+  test "protocol_version should return version supported by client and server" do
+    assert ["3.0", "4.0"].include?(@@sedna.protocol_version)
+  end
+
+  test "protocol_version should return nil if closed" do
+    sedna = Sedna.connect @@spec
+    sedna.close
+    assert_nil sedna.protocol_version
+  end
+
   # Test sedna.reset.
   test "reset should return nil" do
     assert_nil @@sedna.reset
@@ -216,6 +240,15 @@ class SednaTest < Test::Unit::TestCase
     @@sedna.execute "drop document '#{__method__}'" rescue nil
   end
   
+  test "reset should count reconnects in reconnect_stats" do
+    Sedna.connect @@spec do |sedna|
+      2.times { sedna.reset }
+      assert_equal 2, sedna.reconnect_stats[:reconnects]
+      assert_equal 0, sedna.reconnect_stats[:failures]
+      assert sedna.reconnect_stats[:max_time] >= sedna.reconnect_stats[:average_time]
+    end
+  end
+
   test "reset should close and reconnect if the connection is open" do
     @@sedna.reset
     assert_nothing_raised do
@@ -247,6 +280,25 @@ class SednaTest < Test::Unit::TestCase
     end
   end
 
+  test "reset should make the given number of reconnect attempts" do
+    sedna = Sedna.connect @@spec.merge(:reconnect_attempts => 3, :reconnect_delay => 0.01)
+    sedna.instance_variable_set :@host, "non-existent-host"
+    assert_raises Sedna::ConnectionError do
+      sedna.reset
+    end
+    assert_equal 3, sedna.reconnect_stats[:attempts]
+    assert_equal 1, sedna.reconnect_stats[:failures]
+  end
+
+  test "reset should not retry when credentials are incorrect" do
+    sedna = Sedna.connect @@spec.merge(:reconnect_attempts => 3)
+    sedna.instance_variable_set :@username, "non-existent-user"
+    assert_raises Sedna::AuthenticationError do
+      sedna.reset
+    end
+    assert_equal 1, sedna.reconnect_stats[:attempts]
+  end
+
   test "reset should preserve disabled autocommit status" do
     Sedna.connect @@spec do |sedna|
       sedna.autocommit = false
@@ -291,6 +343,21 @@ class SednaTest < Test::Unit::TestCase
     assert_equal [str], @@sedna.execute(str)
   end
 
+  test "execute should return results larger than the read buffer completely" do
+    str = "<large>" << ("x" * 100000) << "</large>"
+    assert_equal [str, str], @@sedna.execute("#{str}, #{str}")
+  end
+
+  test "execute should return results in sxml format if requested" do
+    assert_match(/\A\(test\b/, @@sedna.execute("<test/>", :format => :sxml).first)
+  end
+
+  test "execute should raise ArgumentError for unknown result format" do
+    assert_raises ArgumentError do
+      @@sedna.execute "<test/>", :format => :json
+    end
+  end
+
   test "execute should fail if autocommit is false" do
     Sedna.connect @@spec do |sedna|
       sedna.autocommit = false
@@ -343,14 +410,17 @@ class SednaTest < Test::Unit::TestCase
   
   test "execute should quit if exception is raised in it by another thread in ruby 19" do
     @@sedna.execute "drop document '#{__method__}'" rescue nil
+    # An interrupted connection has to be reset, so do not use the shared one.
+    sedna = Sedna.connect @@spec
     begin
       thread = Thread.new do
-        @@sedna.execute "create document '#{__method__}'" rescue nil
+        sedna.execute "create document '#{__method__}'" rescue nil
       end
       thread.raise
       thread.join
     rescue
     end
+    sedna.close
     count = @@sedna.execute("count(doc('$documents')//*[@name='#{__method__}'])").first.to_i
     if RUBY_VERSION < "1.9"
       assert_equal 1, count
@@ -359,10 +429,160 @@ class SednaTest < Test::Unit::TestCase
     end
   end
   
+  test "execute should be interrupted while reading results if exception is raised by another thread" do
+    Sedna.connect @@spec do |sedna|
+      thread = Thread.new do
+        sedna.execute "for $x in 1 to 10000000 return <node/>"
+      end
+      sleep 0.5
+      thread.raise RuntimeError
+      started = Time.now
+      assert_raises RuntimeError do
+        thread.join
+      end
+      assert Time.now - started < 1
+    end
+  end
+
   test "query should be alias of execute" do
     assert_equal ["<test/>"], @@sedna.query("<test/>")
   end
 
+  test "execute should yield results if block is given" do
+    results = []
+    assert_nil @@sedna.execute("<test/>, <test/>") { |result| results << result }
+    assert_equal ["<test/>", "<test/>"], results
+  end
+
+  # Test sedna.each_result.
+  test "each_result should yield each result" do
+    results = []
+    @@sedna.each_result("<a/>, <b/>, <c/>") { |result| results << result }
+    assert_equal ["<a/>", "<b/>", "<c/>"], results
+  end
+
+  test "each_result should return nil" do
+    assert_nil @@sedna.each_result("<test/>") { }
+  end
+
+  test "each_result should not yield for data structure query" do
+    @@sedna.execute("drop document '#{__method__}'") rescue nil
+    @@sedna.each_result("create document '#{__method__}'") { raise "block should not be run" }
+    @@sedna.execute("drop document '#{__method__}'") rescue nil
+  end
+
+  test "each_result should return enumerator if no block is given" do
+    assert_equal ["<a/>", "<b/>"], @@sedna.each_result("<a/>, <b/>").to_a
+  end if defined? Enumerator
+
+  test "each_result should strip first newline of all but first results" do
+    @@sedna.execute("drop document '#{__method__}'") rescue nil
+    @@sedna.execute("create document '#{__method__}'")
+    @@sedna.execute("update insert <test><a>\n\nt</a><a>\n\nt</a></test> into doc('#{__method__}')")
+    results = []
+    @@sedna.each_result("doc('#{__method__}')/test/a/text()") { |result| results << result }
+    assert_equal ["\n\nt", "\n\nt"], results
+    @@sedna.execute("drop document '#{__method__}'") rescue nil
+  end
+
+  test "each_result should allow queries after iteration was stopped early" do
+    @@sedna.each_result("<a/>, <b/>, <c/>") { break }
+    assert_equal ["<test/>"], @@sedna.execute("<test/>")
+  end
+
+  test "each_result should fail with Sedna::Exception for invalid statements" do
+    assert_raises Sedna::Exception do
+      @@sedna.each_result("INVALID") { }
+    end
+  end
+
+  test "each_result should fail with Sedna::ConnectionError if connection is closed" do
+    Sedna.connect @@spec do |sedna|
+      sedna.close
+      assert_raises Sedna::ConnectionError do
+        sedna.each_result("<test/>") { }
+      end
+    end
+  end
+
+  # Test sedna.execute_batch.
+  test "execute_batch should return outcome of each statement" do
+    @@sedna.execute "drop document '#{__method__}'" rescue nil
+    @@sedna.execute "create document '#{__method__}'"
+    assert_equal [:update, :query, :update], @@sedna.execute_batch([
+      "update insert <test>a</test> into doc('#{__method__}')",
+      "<test/>",
+      "update insert <test>b</test> into doc('#{__method__}')"
+    ])
+    assert_equal ["a", "b"], @@sedna.execute("doc('#{__method__}')/test/text()")
+    @@sedna.execute "drop document '#{__method__}'" rescue nil
+  end
+
+  test "execute_batch should return empty array if no statements are given" do
+    assert_equal [], @@sedna.execute_batch([])
+  end
+
+  test "execute_batch should execute many statements" do
+    @@sedna.execute "drop document '#{__method__}'" rescue nil
+    @@sedna.execute "create document '#{__method__}'"
+    @@sedna.execute "update insert <test/> into doc('#{__method__}')"
+    @@sedna.execute_batch Array.new(100) { |i| "update insert <a>#{i}</a> into doc('#{__method__}')/test" }
+    assert_equal 100, @@sedna.execute("count(doc('#{__method__}')/test/a)").first.to_i
+    @@sedna.execute "drop document '#{__method__}'" rescue nil
+  end
+
+  test "execute_batch should fail with Sedna::BatchError with index of failed statement" do
+    exc = nil
+    begin
+      @@sedna.execute_batch ["<a/>", "<b/>", "FAILS", "<c/>"]
+    rescue Sedna::BatchError => exc
+    end
+    assert_equal 2, exc.index
+    assert_equal "XPDY0002", exc.code
+  end
+
+  test "execute_batch should roll back all statements if one of them fails" do
+    @@sedna.execute "drop document '#{__method__}'" rescue nil
+    @@sedna.execute "create document '#{__method__}'"
+    @@sedna.execute_batch([
+      "update insert <test>a</test> into doc('#{__method__}')",
+      "FAILS"
+    ]) rescue nil
+    assert_equal 0, @@sedna.execute("count(doc('#{__method__}')/test)").first.to_i
+    @@sedna.execute "drop document '#{__method__}'" rescue nil
+  end
+
+  test "execute_batch should allow queries after a statement failed" do
+    @@sedna.execute_batch ["FAILS"] * 20 rescue nil
+    assert_equal ["<test/>"], @@sedna.execute("<test/>")
+  end
+
+  test "execute_batch should be part of transaction if called inside one" do
+    @@sedna.execute "drop document '#{__method__}'" rescue nil
+    @@sedna.execute "create document '#{__method__}'"
+    @@sedna.transaction do
+      @@sedna.execute_batch ["update insert <test>a</test> into doc('#{__method__}')"]
+      @@sedna.rollback
+    end rescue nil
+    assert_equal 0, @@sedna.execute("count(doc('#{__method__}')/test)").first.to_i
+    @@sedna.execute "drop document '#{__method__}'" rescue nil
+  end
+
+  test "execute_batch should raise TypeError if statements cannot be converted to String" do
+    assert_raises TypeError do
+      @@sedna.execute_batch [Object.new]
+    end
+  end
+
+  test "execute_batch should fail with Sedna::ConnectionError if connection is closed" do
+    Sedna.connect @@spec do |sedna|
+      sedna.close
+      assert_raises Sedna::ConnectionError do
+        sedna.execute_batch ["<test/>"]
+      end
+    end
+  end
+
   # Test sedna.load_document.
   test "load_document should raise TypeError if document argument cannot be converted to String" do
     assert_raises TypeError do
@@ -474,6 +694,33 @@ class SednaTest < Test::Unit::TestCase
     @@sedna.execute "drop document '#{__method__}'" rescue nil
   end
 
+  test "load_document should create document if given document is file" do
+    doc = "<?xml version=\"1.0\" standalone=\"yes\"?>\n<document>" << ("\n  <some_very_often_repeated_node/>" * 800) << "\n</document>"
+    file = Tempfile.new "sedna"
+    file.write doc
+    file.rewind
+
+    @@sedna.execute "drop document '#{__method__}'" rescue nil
+    @@sedna.load_document file, __method__.to_s, nil
+    assert_equal doc.length, @@sedna.execute("doc('#{__method__}')").first.length
+    assert file.eof?
+    @@sedna.execute "drop document '#{__method__}'" rescue nil
+    file.close!
+  end
+
+  test "load_document should load remaining data if given document is io object that was partially read" do
+    doc = "<?xml version=\"1.0\" standalone=\"yes\"?>\n<document>" << ("\n  <some_very_often_repeated_node/>" * 800) << "\n</document>"
+    p_out, p_in = IO.pipe
+    p_in.write "<ignored/>\n" << doc
+    p_in.close
+    p_out.gets
+
+    @@sedna.execute "drop document '#{__method__}'" rescue nil
+    @@sedna.load_document p_out, __method__.to_s, nil
+    assert_equal doc.length, @@sedna.execute("doc('#{__method__}')").first.length
+    @@sedna.execute "drop document '#{__method__}'" rescue nil
+  end
+
   test "load_document should raise Sedna::Exception if given document is empty string" do
     @@sedna.execute "drop document '#{__method__}'" rescue nil
     e = nil
@@ -583,7 +830,254 @@ class SednaTest < Test::Unit::TestCase
       end
     end
   end
-  
+
+  test "autocommit should commit updates and return results of queries" do
+    @@sedna.execute "drop document '#{__method__}'" rescue nil
+    @@sedna.execute "create document '#{__method__}'"
+    Sedna.connect @@spec do |sedna|
+      assert_nil sedna.execute("update insert <test>test</test> into doc('#{__method__}')")
+      assert_equal ["<test>test</test>"], sedna.execute("doc('#{__method__}')/test")
+      assert_nil sedna.transaction
+      sedna.rollback
+    end
+    assert_equal 1, @@sedna.execute("count(doc('#{__method__}')/test)").first.to_i
+    @@sedna.execute "drop document '#{__method__}'" rescue nil
+  end
+
+  test "autocommit should commit updates that do not start with the update keyword" do
+    @@sedna.execute "drop document '#{__method__}'" rescue nil
+    @@sedna.execute "create document '#{__method__}'"
+    Sedna.connect @@spec do |sedna|
+      assert_nil sedna.execute("(: comment :) update insert <test>test</test> into doc('#{__method__}')")
+      assert_nil sedna.execute("\n  update insert <test>test</test> into doc('#{__method__}')")
+      assert_equal ["<test/>"], sedna.execute("\n  <test/>")
+      assert_nil sedna.transaction
+      sedna.rollback
+    end
+    assert_equal 2, @@sedna.execute("count(doc('#{__method__}')/test)").first.to_i
+    @@sedna.execute "drop document '#{__method__}'" rescue nil
+  end
+
+  test "autocommit should return results of queries that start like updates" do
+    Sedna.connect @@spec do |sedna|
+      assert_equal ["<update/>"], sedna.execute("<update/>")
+      assert_equal ["update"], sedna.execute("'update'")
+      assert_nil sedna.transaction
+      sedna.rollback
+    end
+  end
+
+  # Test sedna.typed_results= / sedna.typed_results.
+  test "typed_results should be false by default" do
+    Sedna.connect @@spec do |sedna|
+      assert_equal false, sedna.typed_results
+    end
+  end
+
+  test "typed_results should be true if given as connection detail" do
+    Sedna.connect @@spec.merge(:typed_results => true) do |sedna|
+      assert_equal true, sedna.typed_results
+    end
+  end
+
+  test "typed_results should not change results that are nodes or strings" do
+    Sedna.connect @@spec do |sedna|
+      sedna.typed_results = true
+      assert_equal ["<node/>", "text"], sedna.execute("<node/>, 'text'")
+    end
+  end
+
+  test "typed_results should return atomic values as ruby objects if types are sent by server" do
+    Sedna.connect @@spec do |sedna|
+      sedna.typed_results = true
+      results = sedna.execute "12345678901234567890, 42, xs:double(0.5), 1 = 1, xs:dateTime('2010-05-29T12:00:00Z')"
+      if results.first.kind_of? String
+        # Protocol versions before 4.0 do not send the types of items.
+        assert_equal ["12345678901234567890", "42", "0.5", "true", "2010-05-29T12:00:00Z"], results
+      else
+        assert_equal [12345678901234567890, 42, 0.5, true, Time.utc(2010, 5, 29, 12)], results
+      end
+    end
+  end
+
+  # Test sedna.cache= / sedna.cache.
+  test "cache should be nil by default" do
+    assert_nil @@sedna.cache
+  end
+
+  test "cache should answer identical queries from cache" do
+    Sedna.connect @@spec.merge(:cache => Sedna::Cache.new) do |sedna|
+      sedna.execute("<node/>").first << "changed"
+      assert_equal [["<node/>"], ["<node/>"]], [sedna.execute("<node/>"), sedna.execute("<node/>")]
+      assert_equal [2, 1], [sedna.cache.hits, sedna.cache.misses]
+    end
+  end
+
+  test "cache should be flushed by updates" do
+    Sedna.connect @@spec.merge(:cache => Sedna::Cache.new) do |sedna|
+      sedna.execute "drop document '#{__method__}'" rescue nil
+      sedna.load_document "<test/>", __method__.to_s
+      assert_equal ["<test/>"], sedna.execute("doc('#{__method__}')/test")
+      sedna.execute "update insert <node/> into doc('#{__method__}')/test"
+      assert_equal ["<test><node/></test>"], sedna.execute("doc('#{__method__}')/test")
+      sedna.execute "drop document '#{__method__}'" rescue nil
+    end
+  end
+
+  test "cache should be bypassed inside transactions" do
+    Sedna.connect @@spec.merge(:cache => Sedna::Cache.new) do |sedna|
+      sedna.transaction { 2.times { sedna.execute "<node/>" } }
+      assert_equal [0, 0, 0], [sedna.cache.hits, sedna.cache.misses, sedna.cache.length]
+    end
+  end
+
+  test "cache should evict least recently used results if full" do
+    Sedna.connect @@spec.merge(:cache => Sedna::Cache.new(:size => 100)) do |sedna|
+      sedna.execute "'#{"a" * 30}'"
+      sedna.execute "'#{"b" * 30}'"
+      sedna.execute "'#{"c" * 30}'"
+      assert sedna.cache.bytes <= 100
+      assert_equal 1, sedna.cache.length
+    end
+  end
+
+  # Test sedna.read_only= / sedna.read_only.
+  test "read_only should be false by default" do
+    assert_equal false, @@sedna.read_only
+  end
+
+  test "read_only should be true if given as connection detail" do
+    Sedna.connect @@spec.merge(:read_only => true) do |sedna|
+      assert_equal true, sedna.read_only
+    end
+  end
+
+  test "read_only should allow queries but fail updates in autocommit mode" do
+    Sedna.connect @@spec.merge(:read_only => true) do |sedna|
+      sedna.execute "drop document '#{__method__}'" rescue nil
+      sedna.load_document "<test/>", __method__.to_s
+      assert_equal ["<test/>"], sedna.execute("doc('#{__method__}')/test")
+      assert_raises Sedna::Exception do
+        sedna.execute "update insert <node/> into doc('#{__method__}')/test"
+      end
+      sedna.read_only = false
+      sedna.execute "drop document '#{__method__}'"
+    end
+  end
+
+  test "read_only should still fail updates after reset" do
+    Sedna.connect @@spec.merge(:read_only => true) do |sedna|
+      sedna.execute "drop document '#{__method__}'" rescue nil
+      sedna.reset
+      assert_raises Sedna::Exception do
+        sedna.execute "create document '#{__method__}'"
+      end
+    end
+  end
+
+  # Test sedna.query_timeout= / sedna.socket_timeout=.
+  test "query_timeout and socket_timeout should be nil by default" do
+    assert_nil @@sedna.query_timeout
+    assert_nil @@sedna.socket_timeout
+  end
+
+  test "timeouts should be set if given as connection details" do
+    Sedna.connect @@spec.merge(:query_timeout => 10, :socket_timeout => 2.5) do |sedna|
+      assert_equal 10, sedna.query_timeout
+      assert_equal 2.5, sedna.socket_timeout
+      assert_equal ["<test/>"], sedna.execute("<test/>")
+    end
+  end
+
+  test "execute should accept timeout option" do
+    assert_equal ["<test/>"], @@sedna.execute("<test/>", :timeout => 10)
+    assert_nil @@sedna.query_timeout
+  end
+
+  test "timeouts should raise argument error if negative" do
+    assert_raises ArgumentError do
+      @@sedna.query_timeout = -1
+    end
+    assert_raises ArgumentError do
+      @@sedna.socket_timeout = -1
+    end
+  end
+
+  # Test sedna.stats.
+  test "stats should count messages and round trips of statements" do
+    Sedna.connect @@spec do |sedna|
+      assert_equal 1, sedna.stats[:connects]
+      sedna.stats_clear
+      3.times { sedna.execute "<test/>" }
+      stats = sedna.stats
+      assert stats[:messages_sent] > 0
+      assert stats[:bytes_received] > stats[:messages_received]
+      assert_equal 3, stats[:round_trips][:execute][:count]
+      assert_equal 3, stats[:round_trips][:execute][:histogram].inject(0) { |sum, count| sum + count }
+      assert stats[:round_trips][:execute][:max_time] >= stats[:round_trips][:execute][:average_time]
+    end
+  end
+
+  test "stats should count commits and rollbacks" do
+    Sedna.connect @@spec do |sedna|
+      sedna.transaction { sedna.execute "<test/>" }
+      sedna.transaction
+      sedna.rollback
+      assert_equal 1, sedna.stats[:commits]
+      assert_equal 1, sedna.stats[:rollbacks]
+    end
+  end
+
+  test "stats should count reconnects and be cleared by stats_clear" do
+    Sedna.connect @@spec do |sedna|
+      sedna.reset
+      assert_equal 2, sedna.stats[:connects]
+      assert_equal 1, sedna.stats[:reconnects]
+      sedna.stats_clear
+      assert_equal 0, sedna.stats[:messages_received]
+      assert_equal 0, sedna.stats[:round_trips][:connect][:count]
+    end
+  end
+
+  # Test sedna.instrument.
+  test "instrument should report queries with timing and byte counts" do
+    Sedna.connect @@spec do |sedna|
+      events = []
+      sedna.instrument { |*args| events << args }
+      sedna.execute "<test/>"
+      name, start, finish, id, payload = events.first
+      assert_equal "execute.sedna", name
+      assert_equal "<test/>", payload[:query]
+      assert finish >= start
+      assert payload[:duration] >= 0
+      assert payload[:bytes_sent] > 0
+      assert events.map { |event| event[0] }.include?("next.sedna")
+      assert_equal((1..events.length).to_a, events.map { |event| event[3] })
+    end
+  end
+
+  test "instrument should report transactions and reconnects" do
+    Sedna.connect @@spec do |sedna|
+      names = []
+      sedna.instrument { |name, *args| names << name }
+      sedna.transaction { sedna.execute "<test/>" }
+      sedna.reset
+      assert_equal "begin.sedna", names.first
+      assert names.include?("commit.sedna")
+      assert_equal ["close.sedna", "connect.sedna"], names.last(2)
+    end
+  end
+
+  test "instrument should stop reporting if called without block" do
+    Sedna.connect @@spec do |sedna|
+      events = []
+      sedna.instrument { |*args| events << args }
+      sedna.instrument
+      sedna.execute "<test/>"
+      assert events.empty?
+    end
+  end
+
   # Test sedna.transaction.
   test "transaction should return nil if called without block" do
     assert_nil @@sedna.transaction
@@ -728,6 +1222,20 @@ class SednaTest < Test::Unit::TestCase
     end
   end
   
+  test "transaction should fail updates if read only" do
+    @@sedna.execute "drop document '#{__method__}'" rescue nil
+    @@sedna.load_document "<test/>", __method__.to_s
+    assert_raises Sedna::Exception do
+      @@sedna.transaction :read_only => true do
+        assert_equal ["<test/>"], @@sedna.execute("doc('#{__method__}')/test")
+        @@sedna.execute "update insert <node/> into doc('#{__method__}')/test"
+      end
+    end
+    @@sedna.transaction(:read_only => false) { @@sedna.execute "update insert <node/> into doc('#{__method__}')/test" }
+    assert_equal ["<test><node/></test>"], @@sedna.execute("doc('#{__method__}')/test")
+    @@sedna.execute "drop document '#{__method__}'"
+  end
+
   # Test sedna.commit.
   test "commit should commit transaction" do
     @@sedna.execute "drop document '#{__method__}'" rescue nil
@@ -798,7 +1306,165 @@ class SednaTest < Test::Unit::TestCase
     @@sedna.transaction
     assert_nil @@sedna.rollback
   end
-  
+
+  # Test Sedna::Pool.
+  test "pool should return open connection on checkout" do
+    pool = Sedna::Pool.new @@spec
+    sedna = pool.checkout
+    assert_kind_of Sedna, sedna
+    assert sedna.connected?
+    pool.checkin sedna
+    pool.close
+  end
+
+  test "pool should reuse connections that were checked in" do
+    pool = Sedna::Pool.new @@spec
+    sedna = pool.checkout
+    pool.checkin sedna
+    assert_same sedna, pool.checkout
+    pool.close
+  end
+
+  test "pool should fail with Sedna::ConnectionError if no connection becomes available in time" do
+    pool = Sedna::Pool.new @@spec, :size => 1, :timeout => 0.1
+    pool.checkout
+    assert_raises Sedna::ConnectionError do
+      pool.checkout
+    end
+    pool.close
+  end
+
+  test "pool should hand out connection that is checked in by another thread" do
+    pool = Sedna::Pool.new @@spec, :size => 1, :timeout => 5
+    sedna = pool.checkout
+    Thread.new { sleep 0.1; pool.checkin sedna }
+    assert_same sedna, pool.checkout
+    pool.close
+  end
+
+  test "pool should reconnect connections that were closed" do
+    pool = Sedna::Pool.new @@spec
+    sedna = pool.checkout
+    sedna.close
+    pool.checkin sedna
+    sedna = pool.checkout
+    assert sedna.connected?
+    pool.close
+  end
+
+  test "pool should roll back transaction of connection that is checked in" do
+    pool = Sedna::Pool.new @@spec, :size => 1
+    sedna = pool.checkout
+    sedna.transaction
+    pool.checkin sedna
+    sedna = pool.checkout
+    assert_nothing_raised do
+      sedna.transaction do end
+    end
+    pool.close
+  end
+
+  test "pool should close connections that have been idle for too long" do
+    pool = Sedna::Pool.new @@spec, :idle_timeout => 0.1
+    sedna = pool.checkout
+    pool.checkin sedna
+    sleep 0.2
+    assert_equal 1, pool.reap
+    assert !sedna.connected?
+    pool.close
+  end
+
+  test "pool with should yield connection and return result of block" do
+    pool = Sedna::Pool.new @@spec
+    assert_equal ["<test/>"], pool.with { |sedna| sedna.execute "<test/>" }
+    pool.close
+  end
+
+  test "pool with should check in connection if exception is raised inside block" do
+    pool = Sedna::Pool.new @@spec, :size => 1, :timeout => 0.1
+    begin
+      pool.with { raise Exception }
+    rescue Exception
+    end
+    assert_nothing_raised do
+      pool.with { }
+    end
+    pool.close
+  end
+
+  test "pool should be usable from different threads" do
+    pool = Sedna::Pool.new @@spec, :size => 2
+    threads = (1..5).map do |i|
+      Thread.new { pool.with { |sedna| sedna.execute "<test>#{i}</test>" } }
+    end
+    assert_equal (1..5).map { |i| ["<test>#{i}</test>"] }, threads.map { |thread| thread.value }
+    pool.close
+  end
+
+  test "pool should fail with Sedna::ConnectionError after it has been closed" do
+    pool = Sedna::Pool.new @@spec
+    pool.close
+    assert_raises Sedna::ConnectionError do
+      pool.checkout
+    end
+  end
+
+  test "pool should raise ArgumentError if size is less than one" do
+    assert_raises ArgumentError do
+      Sedna::Pool.new @@spec, :size => 0
+    end
+  end
+
+  # Test Sedna.bulk_load.
+  test "bulk_load should load all documents with several workers" do
+    names = (1..6).map { |i| "#{__method__}_#{i}" }
+    names.each { |name| @@sedna.execute "drop document '#{name}'" rescue nil }
+    report = Sedna.bulk_load @@spec, names.map { |name| [name, "<#{name}/>"] }, :workers => 3
+    assert_equal [6, 0, [nil] * 6], [report.loaded, report.failed, report.results]
+    names.each { |name| assert_equal "<#{name}/>", @@sedna.execute("doc('#{name}')").first }
+    names.each { |name| @@sedna.execute "drop document '#{name}'" rescue nil }
+  end
+
+  test "bulk_load should report documents that could not be loaded and continue" do
+    names = (1..3).map { |i| "#{__method__}_#{i}" }
+    names.each { |name| @@sedna.execute "drop document '#{name}'" rescue nil }
+    report = Sedna.bulk_load @@spec, [[names[0], "<doc/>"], [names[1], "<doc/> invalid"], [names[2], "<doc/>"]], :workers => 2
+    assert_equal [2, 1], [report.loaded, report.failed]
+    assert_equal [NilClass, Sedna::Exception, NilClass], report.results.map { |result| result.class }
+    assert_equal "<doc/>", @@sedna.execute("doc('#{names[2]}')").first
+    names.each { |name| @@sedna.execute "drop document '#{name}'" rescue nil }
+  end
+
+  test "bulk_load should raise ArgumentError if number of workers is less than one" do
+    assert_raises ArgumentError do
+      Sedna.bulk_load @@spec, [["doc", "<doc/>"]], :workers => 0
+    end
+  end
+
+  # Test sedna.prepare.
+  test "prepare should return statement with names of placeholders" do
+    stmt = @@sedna.prepare "(%{a}, %{b_2}, %{a})"
+    assert_equal [:a, :b_2, :a], stmt.parameters
+  end
+
+  test "prepared statement should substitute parameters as literals" do
+    stmt = @@sedna.prepare "(%{str}, %{int}, %{bool}, %{seq})"
+    assert_equal ["it's \"quoted\" & more", "42", "true", "1", "2"],
+      stmt.execute(:str => "it's \"quoted\" & more", "int" => 42, :bool => true, :seq => [1, 2])
+  end
+
+  test "prepared statement should be executable repeatedly with different values" do
+    stmt = @@sedna.prepare "%{x} * 2"
+    assert_equal [["2"], ["4"], ["6"]], (1..3).map { |x| stmt.execute :x => x }
+    assert_equal 3, stmt.stats[:executions]
+  end
+
+  test "prepared statement should raise ArgumentError if a parameter is missing" do
+    assert_raises ArgumentError do
+      @@sedna.prepare("%{x} + %{y}").execute :x => 1
+    end
+  end
+
   # Test Sedna::Exception#code
   test "code should return error code after connection failure" do
     code = false